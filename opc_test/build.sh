@@ -20,13 +20,26 @@ $CPP_COMPILER -std=c++11 -c security_config.cpp -o security_config.o $FLAGS
 
 # 3. Compile remaining C++ modules
 echo "[3/4] Compiling application logic..."
+$CPP_COMPILER -std=c++11 -c file_buffer.cpp -o file_buffer.o $FLAGS
+$CPP_COMPILER -std=c++11 -c file_stream.cpp -o file_stream.o $FLAGS
+$CPP_COMPILER -std=c++11 -c file_mapping.cpp -o file_mapping.o $FLAGS
+$CPP_COMPILER -std=c++11 -c file_cache.cpp -o file_cache.o $FLAGS
+$CPP_COMPILER -std=c++11 -c file_compress.cpp -o file_compress.o $FLAGS
+$CPP_COMPILER -std=c++11 -c file_digest.cpp -o file_digest.o $FLAGS
+$CPP_COMPILER -std=c++11 -c file_delta.cpp -o file_delta.o $FLAGS
+$CPP_COMPILER -std=c++11 -c file_store.cpp -o file_store.o $FLAGS
+$CPP_COMPILER -std=c++11 -c file_commit.cpp -o file_commit.o $FLAGS
+$CPP_COMPILER -std=c++11 -c file_io.cpp -o file_io.o $FLAGS
+$CPP_COMPILER -std=c++11 -c file_log.cpp -o file_log.o $FLAGS
 $CPP_COMPILER -std=c++11 -c file_manager.cpp -o file_manager.o $FLAGS
+$CPP_COMPILER -std=c++11 -c file_catalog.cpp -o file_catalog.o $FLAGS
+$CPP_COMPILER -std=c++11 -c file_directory.cpp -o file_directory.o $FLAGS
 $CPP_COMPILER -std=c++11 -c main.cpp -o main.o $FLAGS
 
 # 4. Link everything together
 echo "[4/4] Linking executable..."
-$CPP_COMPILER main.o file_manager.o security_config.o open62541.o -o $OUTPUT_NAME \
-    -lpthread -lmbedtls -lmbedx509 -lmbedcrypto
+$CPP_COMPILER main.o file_manager.o file_catalog.o file_directory.o file_buffer.o file_stream.o file_mapping.o file_cache.o file_compress.o file_store.o file_digest.o file_delta.o file_commit.o file_io.o file_log.o security_config.o open62541.o -o $OUTPUT_NAME \
+    -lpthread -lmbedtls -lmbedx509 -lmbedcrypto -lz
 
 if [ $? -eq 0 ]; then
     echo "-------------------------------------------------------"
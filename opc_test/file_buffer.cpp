@@ -0,0 +1,166 @@
+#include "file_buffer.h"
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+
+/* Number of doubling chunks before the size is capped at FILEBUFFER_MAX_CHUNK */
+static size_t geometricChunks(void) {
+    size_t n = 1;
+    while((FILEBUFFER_MIN_CHUNK << (n - 1)) < FILEBUFFER_MAX_CHUNK)
+        n++;
+    return n;
+}
+
+static size_t chunkCapacity(size_t k) {
+    return (k < geometricChunks()) ? (FILEBUFFER_MIN_CHUNK << k) : FILEBUFFER_MAX_CHUNK;
+}
+
+static size_t chunkStart(size_t k) {
+    size_t g = geometricChunks();
+    if(k < g)
+        return FILEBUFFER_MIN_CHUNK * (((size_t)1 << k) - 1);
+    return FILEBUFFER_MIN_CHUNK * (((size_t)1 << g) - 1) + (k - g) * FILEBUFFER_MAX_CHUNK;
+}
+
+/* Maps a byte offset to its chunk index and the offset inside that chunk */
+static void locate(size_t offset, size_t *chunk, size_t *inChunk) {
+    size_t g = geometricChunks();
+    size_t geometricEnd = chunkStart(g);
+    size_t k;
+    if(offset >= geometricEnd) {
+        k = g + (offset - geometricEnd) / FILEBUFFER_MAX_CHUNK;
+    } else {
+        k = 0;
+        while(offset >= chunkStart(k + 1))
+            k++;
+    }
+    *chunk = k;
+    *inChunk = offset - chunkStart(k);
+}
+
+/* Makes sure the chunk that holds byte `offset` exists */
+static UA_StatusCode ensureChunk(FileBuffer *buf, size_t offset, FileBufferStats *stats) {
+    size_t k, inChunk;
+    locate(offset, &k, &inChunk);
+
+    while(buf->chunksSize <= k) {
+        if(buf->chunksSize == buf->chunksCapacity) {
+            size_t newCap = buf->chunksCapacity ? buf->chunksCapacity * 2 : 8;
+            UA_Byte **dir = (UA_Byte**)realloc(buf->chunks, newCap * sizeof(UA_Byte*));
+            if(!dir)
+                return UA_STATUSCODE_BADOUTOFMEMORY;
+            if(stats) {
+                stats->reallocs++;
+                stats->bytesRelocated += buf->chunksSize * sizeof(UA_Byte*);
+            }
+            buf->chunks = dir;
+            buf->chunksCapacity = newCap;
+        }
+
+        UA_Byte *c = (UA_Byte*)malloc(chunkCapacity(buf->chunksSize));
+        if(!c)
+            return UA_STATUSCODE_BADOUTOFMEMORY;
+        if(stats)
+            stats->chunkAllocs++;
+        buf->chunks[buf->chunksSize++] = c;
+    }
+    return UA_STATUSCODE_GOOD;
+}
+
+void fileBufferInit(FileBuffer *buf) {
+    memset(buf, 0, sizeof(FileBuffer));
+}
+
+void fileBufferClear(FileBuffer *buf) {
+    for(size_t i = 0; i < buf->chunksSize; i++)
+        free(buf->chunks[i]);
+    free(buf->chunks);
+    fileBufferInit(buf);
+}
+
+UA_StatusCode fileBufferWrite(FileBuffer *buf, size_t offset, const UA_Byte *data,
+                              size_t length, FileBufferStats *stats) {
+    if(offset > buf->length)
+        return UA_STATUSCODE_BADINVALIDARGUMENT;
+
+    while(length > 0) {
+        UA_StatusCode res = ensureChunk(buf, offset, stats);
+        if(res != UA_STATUSCODE_GOOD)
+            return res;
+
+        size_t k, inChunk;
+        locate(offset, &k, &inChunk);
+        size_t n = chunkCapacity(k) - inChunk;
+        if(n > length)
+            n = length;
+
+        memcpy(buf->chunks[k] + inChunk, data, n);
+        if(stats)
+            stats->bytesCopied += n;
+        offset += n;
+        if(offset > buf->length)
+            buf->length = offset;
+        data += n;
+        length -= n;
+    }
+    return UA_STATUSCODE_GOOD;
+}
+
+UA_StatusCode fileBufferAppend(FileBuffer *buf, const UA_Byte *data, size_t length,
+                               FileBufferStats *stats) {
+    return fileBufferWrite(buf, buf->length, data, length, stats);
+}
+
+size_t fileBufferRead(const FileBuffer *buf, size_t offset, UA_Byte *dst, size_t length) {
+    if(offset >= buf->length)
+        return 0;
+    if(length > buf->length - offset)
+        length = buf->length - offset;
+
+    size_t done = 0;
+    while(done < length) {
+        size_t k, inChunk;
+        locate(offset + done, &k, &inChunk);
+        size_t n = chunkCapacity(k) - inChunk;
+        if(n > length - done)
+            n = length - done;
+        memcpy(dst + done, buf->chunks[k] + inChunk, n);
+        done += n;
+    }
+    return done;
+}
+
+UA_StatusCode fileBufferLoad(FileBuffer *buf, FILE *f, FileBufferStats *stats) {
+    for(;;) {
+        UA_StatusCode res = ensureChunk(buf, buf->length, stats);
+        if(res != UA_STATUSCODE_GOOD)
+            return res;
+
+        size_t k, inChunk;
+        locate(buf->length, &k, &inChunk);
+        size_t n = fread(buf->chunks[k] + inChunk, 1, chunkCapacity(k) - inChunk, f);
+        buf->length += n;
+        if(n < chunkCapacity(k) - inChunk)
+            return ferror(f) ? UA_STATUSCODE_BADINTERNALERROR : UA_STATUSCODE_GOOD;
+    }
+}
+
+UA_StatusCode fileBufferSave(const FileBuffer *buf, int fd) {
+    size_t offset = 0;
+    for(size_t k = 0; k < buf->chunksSize && offset < buf->length; k++) {
+        size_t n = chunkCapacity(k);
+        if(n > buf->length - offset)
+            n = buf->length - offset;
+        for(size_t done = 0; done < n;) {
+            ssize_t w = write(fd, buf->chunks[k] + done, n - done);
+            if(w < 0 && errno == EINTR)
+                continue;
+            if(w < 0)
+                return UA_STATUSCODE_BADINTERNALERROR;
+            done += (size_t)w;
+        }
+        offset += n;
+    }
+    return UA_STATUSCODE_GOOD;
+}
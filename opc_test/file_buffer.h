@@ -0,0 +1,47 @@
+#ifndef FILE_BUFFER_H
+#define FILE_BUFFER_H
+
+extern "C" {
+#include "open62541.h"
+}
+#include <cstdio>
+
+/* Segmented in-memory file content. Chunk k holds FILEBUFFER_MIN_CHUNK << k
+ * bytes until FILEBUFFER_MAX_CHUNK is reached, then every further chunk is
+ * FILEBUFFER_MAX_CHUNK. Appending never moves bytes that are already stored
+ * and any offset maps to its chunk arithmetically. */
+#define FILEBUFFER_MIN_CHUNK ((size_t)64 * 1024)
+#define FILEBUFFER_MAX_CHUNK ((size_t)4 * 1024 * 1024)
+
+typedef struct {
+    UA_Byte **chunks;        /* chunk directory */
+    size_t   chunksSize;     /* allocated chunks */
+    size_t   chunksCapacity; /* slots in the directory */
+    size_t   length;         /* bytes stored */
+} FileBuffer;
+
+/* Allocation and copy volume, accumulated over the lifetime of a file */
+typedef struct {
+    UA_UInt64 chunkAllocs;     /* data chunks allocated */
+    UA_UInt64 reallocs;        /* chunk directory resizes */
+    UA_UInt64 bytesCopied;     /* payload bytes copied into the buffer */
+    UA_UInt64 bytesRelocated;  /* bytes moved by resizes (directory only) */
+} FileBufferStats;
+
+void fileBufferInit(FileBuffer *buf);
+void fileBufferClear(FileBuffer *buf);
+
+/* Overwrites and/or extends the content at offset (offset <= length) */
+UA_StatusCode fileBufferWrite(FileBuffer *buf, size_t offset, const UA_Byte *data,
+                              size_t length, FileBufferStats *stats);
+UA_StatusCode fileBufferAppend(FileBuffer *buf, const UA_Byte *data, size_t length,
+                               FileBufferStats *stats);
+
+/* Copies up to length bytes starting at offset into dst, returns the count */
+size_t fileBufferRead(const FileBuffer *buf, size_t offset, UA_Byte *dst, size_t length);
+
+/* Appends the remaining content of f, reading directly into chunk memory */
+UA_StatusCode fileBufferLoad(FileBuffer *buf, FILE *f, FileBufferStats *stats);
+UA_StatusCode fileBufferSave(const FileBuffer *buf, int fd);
+
+#endif
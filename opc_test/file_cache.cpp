@@ -0,0 +1,151 @@
+#include "file_cache.h"
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <sys/stat.h>
+
+static std::mutex cacheMutex;
+static std::map<std::string, FileCachePage*> pages;
+static std::vector<FileCachePage*> ring; /* clock order */
+static size_t hand = 0;
+static size_t cachedBytes = 0;
+static size_t capacity = FILECACHE_DEFAULT_CAPACITY;
+static UA_UInt64 hits = 0;
+static UA_UInt64 misses = 0;
+static UA_UInt64 evictions = 0;
+
+static std::string mapKey(const FileCacheKey *key) {
+    char page[8];
+    for(size_t i = 0; i < 8; i++)
+        page[i] = (char)(key->page >> (8 * i));
+    return std::string((const char*)key->id, sizeof(key->id)) + std::string(page, 8);
+}
+
+static void freePage(FileCachePage *p) {
+    free((void*)p->data);
+    free(p);
+}
+
+/* Removes the page at ring[i] from the cache, frees it unless pinned */
+static void dropAt(size_t i) {
+    FileCachePage *p = ring[i];
+    pages.erase(mapKey(&p->key));
+    ring[i] = ring.back();
+    ring.pop_back();
+    cachedBytes -= p->length;
+    p->cached = false;
+    if(p->pins == 0)
+        freePage(p);
+}
+
+/* Advances the clock hand until at most limit bytes are cached. Pinned
+ * pages are skipped, referenced ones get a second chance. */
+static void evictTo(size_t limit) {
+    size_t steps = 2 * ring.size();
+    while(cachedBytes > limit && !ring.empty() && steps-- > 0) {
+        if(hand >= ring.size())
+            hand = 0;
+        FileCachePage *p = ring[hand];
+        if(p->pins > 0) {
+            hand++;
+        } else if(p->referenced) {
+            p->referenced = false;
+            hand++;
+        } else {
+            dropAt(hand); /* the last page moved to hand, look at it next */
+            evictions++;
+        }
+    }
+}
+
+void fileCacheSetCapacity(size_t bytes) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    capacity = bytes;
+    evictTo(capacity);
+}
+
+UA_StatusCode fileCacheFileKey(int fd, FileCacheKey *key) {
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+        return UA_STATUSCODE_BADINTERNALERROR;
+    UA_UInt64 id[4] = {(UA_UInt64)st.st_dev, (UA_UInt64)st.st_ino, (UA_UInt64)st.st_size,
+                       (UA_UInt64)st.st_mtim.tv_sec * 1000000000ULL + (UA_UInt64)st.st_mtim.tv_nsec};
+    memcpy(key->id, id, sizeof(key->id));
+    key->page = 0;
+    return UA_STATUSCODE_GOOD;
+}
+
+FileCachePage *fileCacheGet(const FileCacheKey *key) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    std::map<std::string, FileCachePage*>::iterator it = pages.find(mapKey(key));
+    if(it == pages.end()) {
+        misses++;
+        return NULL;
+    }
+    hits++;
+    it->second->pins++;
+    it->second->referenced = true;
+    return it->second;
+}
+
+FileCachePage *fileCacheInsert(const FileCacheKey *key, UA_Byte *data, size_t length) {
+    FileCachePage *p = (FileCachePage*)calloc(1, sizeof(FileCachePage));
+    if(!p) {
+        free(data);
+        return NULL;
+    }
+    p->data = data;
+    p->length = length;
+    p->key = *key;
+    p->pins = 1;
+
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    std::string k = mapKey(key);
+    std::map<std::string, FileCachePage*>::iterator it = pages.find(k);
+    if(it != pages.end()) {
+        freePage(p);
+        it->second->pins++;
+        it->second->referenced = true;
+        return it->second;
+    }
+
+    if(length <= capacity)
+        evictTo(capacity - length);
+    if(length > capacity || cachedBytes + length > capacity)
+        return p; /* uncached, freed with the last pin */
+    ring.push_back(p);
+    pages[k] = p;
+    p->cached = true;
+    cachedBytes += length;
+    return p;
+}
+
+void fileCacheRelease(FileCachePage *page) {
+    if(!page)
+        return;
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    if(--page->pins == 0 && !page->cached)
+        freePage(page);
+}
+
+void fileCacheGetStats(FileCacheStats *stats) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    stats->hits = hits;
+    stats->misses = misses;
+    stats->evictions = evictions;
+    stats->pages = ring.size();
+    stats->bytes = cachedBytes;
+    stats->capacity = capacity;
+}
+
+void fileCacheClear(void) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    for(size_t i = ring.size(); i > 0; i--) {
+        if(ring[i - 1]->pins == 0)
+            dropAt(i - 1);
+    }
+    hand = 0;
+}
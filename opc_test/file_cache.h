@@ -0,0 +1,70 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+extern "C" {
+#include "open62541.h"
+}
+
+/* Server-wide cache of decoded file content, shared by every handle: the
+ * inflated blocks of compressed files and the pages of store chunks. Five
+ * readers of the same compressed file inflate each block once.
+ *
+ * Pages are pinned while a reader uses them and never evicted while
+ * pinned. Unpinned pages are evicted with the CLOCK algorithm once the
+ * cached bytes exceed the capacity; a page inserted while everything else
+ * is pinned stays uncached and is freed with its last pin. Plain files are
+ * not cached here: their readers share one mapping, see file_mapping.h.
+ *
+ * All functions are thread safe. */
+#define FILECACHE_PAGE_SIZE ((size_t)64 * 1024)
+#define FILECACHE_DEFAULT_CAPACITY ((size_t)64 * 1024 * 1024)
+
+/* Identity of a file version (or of content, such as a chunk hash) and the
+ * page within it */
+typedef struct {
+    UA_Byte id[32];
+    UA_UInt64 page;
+} FileCacheKey;
+
+typedef struct FileCachePage {
+    const UA_Byte *data;
+    size_t length;
+
+    /* Owned by the cache */
+    FileCacheKey key;
+    size_t pins;
+    UA_Boolean referenced; /* used since the clock hand passed */
+    UA_Boolean cached;     /* false once evicted or if it never fit */
+} FileCachePage;
+
+typedef struct {
+    UA_UInt64 hits;
+    UA_UInt64 misses;
+    UA_UInt64 evictions;
+    size_t pages;
+    size_t bytes;
+    size_t capacity;
+} FileCacheStats;
+
+/* Evicts down to the new capacity as far as pins allow */
+void fileCacheSetCapacity(size_t bytes);
+
+/* Key of the file version open as fd: device, inode, mtime and size */
+UA_StatusCode fileCacheFileKey(int fd, FileCacheKey *key);
+
+/* The pinned page for key, NULL on a miss */
+FileCachePage *fileCacheGet(const FileCacheKey *key);
+
+/* Adds a page, taking ownership of data (from malloc) in any case. Returns
+ * it pinned, or the page another thread inserted first. NULL when out of
+ * memory. */
+FileCachePage *fileCacheInsert(const FileCacheKey *key, UA_Byte *data, size_t length);
+
+void fileCacheRelease(FileCachePage *page);
+
+void fileCacheGetStats(FileCacheStats *stats);
+
+/* Frees every unpinned page */
+void fileCacheClear(void);
+
+#endif
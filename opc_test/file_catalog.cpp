@@ -0,0 +1,450 @@
+#include "file_catalog.h"
+#include "file_commit.h"
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <dirent.h>
+#include <sys/stat.h>
+
+/* Directory of a "vdir" entry, file nodes are added by GetFile */
+struct VirtualFolder {
+    char *prefix;
+    char *dir;
+    UA_Boolean writeThrough;
+    UA_NodeId folderId;
+    FileState **states;    /* files that currently have a node */
+    size_t statesSize;
+    size_t statesCapacity;
+};
+
+static UA_Boolean pushState(FileState ***states, size_t *size, size_t *capacity, FileState *fs) {
+    if(*size == *capacity) {
+        size_t newCap = *capacity ? *capacity * 2 : 16;
+        FileState **grown = (FileState**)realloc(*states, newCap * sizeof(FileState*));
+        if(!grown)
+            return false;
+        *states = grown;
+        *capacity = newCap;
+    }
+    (*states)[(*size)++] = fs;
+    return true;
+}
+
+/* Regular files only, without hidden files and commit temporaries. Fills
+ * path with the full path of the entry. */
+static UA_Boolean isCatalogFile(const char *dir, const struct dirent *e,
+                                char *path, size_t pathSize) {
+    if(e->d_name[0] == '.' || strstr(e->d_name, ".part."))
+        return false;
+    if(snprintf(path, pathSize, "%s/%s", dir, e->d_name) >= (int)pathSize)
+        return false;
+
+    /* d_type saves the stat() on file systems that report it */
+    if(e->d_type == DT_UNKNOWN || e->d_type == DT_LNK) {
+        struct stat st;
+        return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+    }
+    return e->d_type == DT_REG;
+}
+
+/* Options after the path of an entry */
+typedef struct {
+    UA_Boolean writeThrough;
+    UA_Boolean compressed;  /* store in the block format */
+    UA_Boolean companion;   /* add "<name>.opcz" serving the compressed form */
+    UA_Boolean dedup;       /* keep the content in the catalog's chunk store */
+} EntryOptions;
+
+static UA_Boolean parseOptions(char *rest, EntryOptions *options) {
+    memset(options, 0, sizeof(EntryOptions));
+    for(char *tok = strtok(rest, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+        if(strcmp(tok, "writethrough") == 0)
+            options->writeThrough = true;
+        else if(strcmp(tok, "compressed") == 0)
+            options->compressed = true;
+        else if(strcmp(tok, "companion") == 0)
+            options->companion = true;
+        else if(strcmp(tok, "dedup") == 0)
+            options->dedup = true;
+        else
+            return false;
+    }
+    return true;
+}
+
+static FileState *addState(UA_Server *server, FileCatalog *catalog, const char *path,
+                           UA_Boolean writeThrough) {
+    FileState *fs = fileStateNew(path, writeThrough);
+    if(fs && !pushState(&catalog->states, &catalog->statesSize, &catalog->statesCapacity, fs)) {
+        fileStateDelete(fs);
+        fs = NULL;
+    }
+    if(!fs)
+        UA_LOG_ERROR(&UA_Server_getConfig(server)->logger, UA_LOGCATEGORY_USERLAND,
+                     "Out of memory adding %s", path);
+    return fs;
+}
+
+static void addEntry(UA_Server *server, UA_NodeId parentId, FileCatalog *catalog,
+                     const char *name, const char *nodeIdStr, const char *path,
+                     const EntryOptions *options) {
+    FileState *fs = addState(server, catalog, path, options->writeThrough);
+    if(!fs)
+        return;
+    fs->compressed = options->compressed;
+    if(options->dedup) {
+        fs->store = catalog->store;
+        fileStoreAttach(catalog->store, path);
+    }
+    if(addFileInstance(server, parentId, name, nodeIdStr, fs) != UA_STATUSCODE_GOOD ||
+       !options->companion)
+        return;
+
+    FileState *packed = addState(server, catalog, path, false);
+    if(!packed)
+        return;
+    packed->companionOf = fs;
+    char packedName[PATH_MAX], packedId[PATH_MAX];
+    snprintf(packedName, sizeof(packedName), "%s.opcz", name);
+    snprintf(packedId, sizeof(packedId), "%s.opcz", nodeIdStr);
+    addFileInstance(server, parentId, packedName, packedId, packed);
+}
+
+/* Adds every regular file of dir as "<prefix>_<file name>" */
+static void addDirectory(UA_Server *server, UA_NodeId parentId, FileCatalog *catalog,
+                         const char *prefix, const char *dir, const EntryOptions *options) {
+    DIR *d = opendir(dir);
+    if(!d) {
+        UA_LOG_WARNING(&UA_Server_getConfig(server)->logger, UA_LOGCATEGORY_USERLAND,
+                       "Cannot scan catalog directory %s", dir);
+        return;
+    }
+
+    struct dirent *e;
+    char path[PATH_MAX];
+    char nodeIdStr[PATH_MAX];
+    while((e = readdir(d)) != NULL) {
+        if(!isCatalogFile(dir, e, path, sizeof(path)))
+            continue;
+        snprintf(nodeIdStr, sizeof(nodeIdStr), "%s_%s", prefix, e->d_name);
+        addEntry(server, parentId, catalog, e->d_name, nodeIdStr, path, options);
+    }
+    closedir(d);
+}
+
+/* Name of a materialized file, the part of its path after the folder */
+static const char *stateName(const VirtualFolder *vf, const FileState *fs) {
+    return fs->persistPath + strlen(vf->dir) + 1;
+}
+
+static UA_Boolean validFileName(const char *name) {
+    return name[0] != '\0' && name[0] != '.' && !strchr(name, '/') && !strstr(name, ".part.");
+}
+
+static UA_StatusCode
+getFileMethod(UA_Server *server, const UA_NodeId*, void*, const UA_NodeId*, void*,
+              const UA_NodeId*, void *objectContext,
+              size_t inputSize, const UA_Variant *input, size_t, UA_Variant *output) {
+    VirtualFolder *vf = (VirtualFolder*)objectContext;
+    if(!vf || inputSize != 1 || !UA_Variant_hasScalarType(&input[0], &UA_TYPES[UA_TYPES_STRING]))
+        return UA_STATUSCODE_BADINVALIDARGUMENT;
+
+    const UA_String *in = (const UA_String*)input[0].data;
+    if(in->length == 0 || in->length > NAME_MAX)
+        return UA_STATUSCODE_BADINVALIDARGUMENT;
+    char name[NAME_MAX + 1];
+    memcpy(name, in->data, in->length);
+    name[in->length] = '\0';
+    if(!validFileName(name) || strlen(name) != in->length)
+        return UA_STATUSCODE_BADINVALIDARGUMENT;
+
+    char nodeIdStr[PATH_MAX];
+    if(snprintf(nodeIdStr, sizeof(nodeIdStr), "%s_%s", vf->prefix, name) >= (int)sizeof(nodeIdStr))
+        return UA_STATUSCODE_BADINVALIDARGUMENT;
+    UA_NodeId nodeId = UA_NODEID_STRING(1, nodeIdStr);
+
+    /* Already materialized */
+    for(size_t i = 0; i < vf->statesSize; i++) {
+        if(strcmp(stateName(vf, vf->states[i]), name) == 0) {
+            vf->states[i]->lastUsed = UA_DateTime_nowMonotonic();
+            return UA_Variant_setScalarCopy(output, &nodeId, &UA_TYPES[UA_TYPES_NODEID]);
+        }
+    }
+
+    char path[PATH_MAX];
+    struct stat st;
+    if(snprintf(path, sizeof(path), "%s/%s", vf->dir, name) >= (int)sizeof(path))
+        return UA_STATUSCODE_BADINVALIDARGUMENT;
+    if(stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+        return UA_STATUSCODE_BADNOTFOUND;
+
+    FileState *fs = fileStateNew(path, vf->writeThrough);
+    if(!fs)
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+    if(!pushState(&vf->states, &vf->statesSize, &vf->statesCapacity, fs)) {
+        fileStateDelete(fs);
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+    }
+    fs->lastUsed = UA_DateTime_nowMonotonic();
+    UA_StatusCode res = addFileInstance(server, vf->folderId, name, nodeIdStr, fs);
+    if(res != UA_STATUSCODE_GOOD) {
+        vf->statesSize--; /* pushed last */
+        fileStateDelete(fs);
+        return res;
+    }
+    return UA_Variant_setScalarCopy(output, &nodeId, &UA_TYPES[UA_TYPES_NODEID]);
+}
+
+static UA_StatusCode
+listFilesMethod(UA_Server*, const UA_NodeId*, void*, const UA_NodeId*, void*,
+                const UA_NodeId*, void *objectContext,
+                size_t, const UA_Variant*, size_t, UA_Variant *output) {
+    VirtualFolder *vf = (VirtualFolder*)objectContext;
+    if(!vf)
+        return UA_STATUSCODE_BADINVALIDARGUMENT;
+    DIR *d = opendir(vf->dir);
+    if(!d)
+        return UA_STATUSCODE_BADNOTFOUND;
+
+    UA_String *names = NULL;
+    size_t namesSize = 0, namesCapacity = 0;
+    UA_StatusCode res = UA_STATUSCODE_GOOD;
+    struct dirent *e;
+    char path[PATH_MAX];
+    while((e = readdir(d)) != NULL) {
+        if(!isCatalogFile(vf->dir, e, path, sizeof(path)))
+            continue;
+        if(namesSize == namesCapacity) {
+            size_t capacity = namesCapacity ? namesCapacity * 2 : 64;
+            UA_String *grown = (UA_String*)UA_realloc(names, capacity * sizeof(UA_String));
+            if(!grown) {
+                res = UA_STATUSCODE_BADOUTOFMEMORY;
+                break;
+            }
+            names = grown;
+            namesCapacity = capacity;
+        }
+        names[namesSize] = UA_STRING_ALLOC(e->d_name);
+        if(!names[namesSize].data) {
+            res = UA_STATUSCODE_BADOUTOFMEMORY;
+            break;
+        }
+        namesSize++;
+    }
+    closedir(d);
+
+    if(res != UA_STATUSCODE_GOOD) {
+        UA_Array_delete(names, namesSize, &UA_TYPES[UA_TYPES_STRING]);
+        return res;
+    }
+    if(namesSize == 0) {
+        UA_free(names);
+        names = (UA_String*)UA_EMPTY_ARRAY_SENTINEL;
+    }
+    UA_Variant_setArray(output, names, namesSize, &UA_TYPES[UA_TYPES_STRING]);
+    return UA_STATUSCODE_GOOD;
+}
+
+/* Drops the nodes of files that have been idle for FILECATALOG_IDLE_TIMEOUT */
+static void evictIdle(UA_Server *server, void *data) {
+    FileCatalog *catalog = (FileCatalog*)data;
+    UA_DateTime now = UA_DateTime_nowMonotonic();
+    char nodeIdStr[PATH_MAX];
+    for(size_t i = 0; i < catalog->foldersSize; i++) {
+        VirtualFolder *vf = catalog->folders[i];
+        for(size_t j = vf->statesSize; j > 0; j--) {
+            FileState *fs = vf->states[j - 1];
+            if(fs->handlesSize > 0 || fs->pendingCommits > 0 ||
+               now - fs->lastUsed < FILECATALOG_IDLE_TIMEOUT)
+                continue;
+            snprintf(nodeIdStr, sizeof(nodeIdStr), "%s_%s", vf->prefix, stateName(vf, fs));
+            UA_Server_deleteNode(server, UA_NODEID_STRING(1, nodeIdStr), true);
+            vf->states[j - 1] = vf->states[--vf->statesSize];
+            fileStateDelete(fs);
+        }
+    }
+}
+
+static void addMethod(UA_Server *server, const VirtualFolder *vf, const char *name,
+                      UA_MethodCallback callback, size_t inputSize, const UA_Argument *input,
+                      const UA_Argument *output) {
+    char nodeIdStr[PATH_MAX];
+    snprintf(nodeIdStr, sizeof(nodeIdStr), "%s/%s", vf->prefix, name);
+    UA_MethodAttributes ma = UA_MethodAttributes_default;
+    ma.displayName = UA_LOCALIZEDTEXT("", (char*)name);
+    ma.executable = true;
+    ma.userExecutable = true;
+    UA_Server_addMethodNode(server, UA_NODEID_STRING(1, nodeIdStr), vf->folderId,
+                            UA_NODEID_NUMERIC(0, UA_NS0ID_HASCOMPONENT),
+                            UA_QUALIFIEDNAME(1, (char*)name), ma, callback,
+                            inputSize, input, 1, output, NULL, NULL);
+}
+
+/* Adds the folder object and its methods, no file nodes */
+static void addVirtualFolder(UA_Server *server, UA_NodeId parentId, FileCatalog *catalog,
+                             const char *prefix, const char *dir, UA_Boolean writeThrough) {
+    VirtualFolder *vf = (VirtualFolder*)calloc(1, sizeof(VirtualFolder));
+    VirtualFolder **folders = (VirtualFolder**)realloc(catalog->folders,
+                                                       (catalog->foldersSize + 1) * sizeof(VirtualFolder*));
+    if(folders)
+        catalog->folders = folders;
+    if(!vf || !folders || !(vf->prefix = strdup(prefix)) || !(vf->dir = strdup(dir))) {
+        if(vf) {
+            free(vf->prefix);
+            free(vf);
+        }
+        UA_LOG_ERROR(&UA_Server_getConfig(server)->logger, UA_LOGCATEGORY_USERLAND,
+                     "Out of memory adding %s", dir);
+        return;
+    }
+    vf->writeThrough = writeThrough;
+    catalog->folders[catalog->foldersSize++] = vf;
+
+    UA_ObjectAttributes oa = UA_ObjectAttributes_default;
+    oa.displayName = UA_LOCALIZEDTEXT("", (char*)prefix);
+    UA_Server_addObjectNode(server, UA_NODEID_STRING(1, (char*)prefix), parentId,
+                            UA_NODEID_NUMERIC(0, UA_NS0ID_HASCOMPONENT),
+                            UA_QUALIFIEDNAME(1, (char*)prefix),
+                            UA_NODEID_NUMERIC(0, UA_NS0ID_FOLDERTYPE),
+                            oa, vf, &vf->folderId);
+
+    UA_Argument fileName;
+    UA_Argument_init(&fileName);
+    fileName.name = UA_STRING((char*)"FileName");
+    fileName.dataType = UA_TYPES[UA_TYPES_STRING].typeId;
+    fileName.valueRank = UA_VALUERANK_SCALAR;
+
+    UA_Argument fileNodeId;
+    UA_Argument_init(&fileNodeId);
+    fileNodeId.name = UA_STRING((char*)"FileNodeId");
+    fileNodeId.dataType = UA_TYPES[UA_TYPES_NODEID].typeId;
+    fileNodeId.valueRank = UA_VALUERANK_SCALAR;
+
+    UA_Argument fileNames;
+    UA_Argument_init(&fileNames);
+    fileNames.name = UA_STRING((char*)"FileNames");
+    fileNames.dataType = UA_TYPES[UA_TYPES_STRING].typeId;
+    fileNames.valueRank = UA_VALUERANK_ONE_DIMENSION;
+
+    addMethod(server, vf, "GetFile", getFileMethod, 1, &fileName, &fileNodeId);
+    addMethod(server, vf, "ListFiles", listFilesMethod, 0, NULL, &fileNames);
+
+    if(catalog->foldersSize == 1)
+        UA_Server_addRepeatedCallback(server, evictIdle, catalog,
+                                      (UA_Double)(FILECATALOG_IDLE_TIMEOUT / UA_DATETIME_MSEC) / 2,
+                                      &catalog->evictCallbackId);
+}
+
+static void addTree(UA_Server *server, UA_NodeId parentId, FileCatalog *catalog,
+                    const char *prefix, const char *dir, UA_Boolean writeThrough) {
+    FileDirectory **trees = (FileDirectory**)realloc(catalog->trees,
+                                                     (catalog->treesSize + 1) * sizeof(FileDirectory*));
+    if(!trees)
+        return;
+    catalog->trees = trees;
+    FileDirectory *tree = fileDirectoryAdd(server, parentId, prefix, dir, writeThrough);
+    if(tree)
+        catalog->trees[catalog->treesSize++] = tree;
+}
+
+UA_StatusCode fileCatalogLoad(UA_Server *server, UA_NodeId parentId,
+                              const char *catalogPath, FileCatalog *catalog) {
+    const UA_Logger *logger = &UA_Server_getConfig(server)->logger;
+    catalog->server = server;
+    FILE *f = fopen(catalogPath, "r");
+    if(!f) {
+        UA_LOG_ERROR(logger, UA_LOGCATEGORY_USERLAND, "Cannot open file catalog %s", catalogPath);
+        return UA_STATUSCODE_BADNOTFOUND;
+    }
+
+    size_t before = catalog->statesSize;
+    char line[3 * PATH_MAX];
+    char first[PATH_MAX], second[PATH_MAX], third[PATH_MAX];
+    unsigned lineNo = 0;
+    while(fgets(line, sizeof(line), f)) {
+        lineNo++;
+        char *hash = strchr(line, '#');
+        if(hash)
+            *hash = '\0';
+
+        int consumed = 0;
+        int fields = sscanf(line, "%4095s %4095s %4095s%n", first, second, third, &consumed);
+        if(fields <= 0)
+            continue;
+
+        /* One chunk store per catalog, for the dedup entries after it */
+        if(strcmp(first, "store") == 0) {
+            if(fields == 2 && !catalog->store)
+                catalog->store = fileStoreOpen(logger, second);
+            else
+                UA_LOG_WARNING(logger, UA_LOGCATEGORY_USERLAND,
+                               "%s:%u: malformed or second store skipped", catalogPath, lineNo);
+            continue;
+        }
+
+        /* Server-wide: the last groupcommit line wins */
+        if(strcmp(first, "groupcommit") == 0) {
+            char *end = NULL;
+            double windowMs = (fields == 2) ? strtod(second, &end) : -1.0;
+            if(end && *end == '\0' && windowMs >= 0.0 && windowMs <= 10000.0)
+                fileCommitSetGroupWindow(windowMs);
+            else
+                UA_LOG_WARNING(logger, UA_LOGCATEGORY_USERLAND,
+                               "%s:%u: malformed groupcommit skipped", catalogPath, lineNo);
+            continue;
+        }
+
+        /* vdir and tree entries take writethrough only. Chunk-stored files
+         * are neither compressed nor have a companion. */
+        EntryOptions options;
+        UA_Boolean folder = strcmp(first, "vdir") == 0 || strcmp(first, "tree") == 0;
+        if(fields < 3 || !parseOptions(line + consumed, &options) ||
+           (folder && (options.compressed || options.companion || options.dedup)) ||
+           (options.dedup && (!catalog->store || options.compressed || options.companion))) {
+            UA_LOG_WARNING(logger, UA_LOGCATEGORY_USERLAND,
+                           "%s:%u: malformed catalog entry skipped", catalogPath, lineNo);
+            continue;
+        }
+
+        if(strcmp(first, "dir") == 0)
+            addDirectory(server, parentId, catalog, second, third, &options);
+        else if(strcmp(first, "vdir") == 0)
+            addVirtualFolder(server, parentId, catalog, second, third, options.writeThrough);
+        else if(strcmp(first, "tree") == 0)
+            addTree(server, parentId, catalog, second, third, options.writeThrough);
+        else
+            addEntry(server, parentId, catalog, first, second, third, &options);
+    }
+    fclose(f);
+
+    UA_LOG_INFO(logger, UA_LOGCATEGORY_USERLAND, "Catalog %s: %zu files",
+                catalogPath, catalog->statesSize - before);
+    return UA_STATUSCODE_GOOD;
+}
+
+void fileCatalogClear(FileCatalog *catalog) {
+    if(catalog->foldersSize > 0)
+        UA_Server_removeCallback(catalog->server, catalog->evictCallbackId);
+    for(size_t i = 0; i < catalog->foldersSize; i++) {
+        VirtualFolder *vf = catalog->folders[i];
+        for(size_t j = 0; j < vf->statesSize; j++)
+            fileStateDelete(vf->states[j]);
+        free(vf->states);
+        UA_NodeId_clear(&vf->folderId);
+        free(vf->prefix);
+        free(vf->dir);
+        free(vf);
+    }
+    free(catalog->folders);
+
+    for(size_t i = 0; i < catalog->treesSize; i++)
+        fileDirectoryDelete(catalog->trees[i]);
+    free(catalog->trees);
+
+    for(size_t i = 0; i < catalog->statesSize; i++)
+        fileStateDelete(catalog->states[i]);
+    free(catalog->states);
+    fileStoreDelete(catalog->store);
+    memset(catalog, 0, sizeof(FileCatalog));
+}
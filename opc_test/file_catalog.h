@@ -0,0 +1,78 @@
+#ifndef FILE_CATALOG_H
+#define FILE_CATALOG_H
+
+extern "C" {
+#include "open62541.h"
+}
+#include "file_manager.h"
+#include "file_directory.h"
+
+/* The FileType instances of a device, read from a catalog file. One entry
+ * per line, fields separated by whitespace, '#' starts a comment:
+ *
+ *   <BrowseName> <NodeIdString> <path> [writethrough] [compressed] [companion] [dedup]
+ *   dir <NodeIdPrefix> <directory> [writethrough] [compressed] [companion] [dedup]
+ *   vdir <NodeIdPrefix> <directory> [writethrough]
+ *   tree <NodeIdPrefix> <directory> [writethrough]
+ *   store <directory>
+ *   groupcommit <milliseconds>
+ *
+ * A "dir" line adds every regular file of the directory under its file name,
+ * with the node id "<NodeIdPrefix>_<file name>". Paths must not contain
+ * whitespace; relative ones start from the working directory. A state holds no buffers or handles until the file is opened
+ * and does not stat() the file until its properties are read, so a catalog
+ * of many thousand files is cheap to load.
+ *
+ * "compressed" stores the file in the block format of file_compress.h,
+ * clients still read and write the plain content. "companion" adds a
+ * read-only "<BrowseName>.opcz" / "<NodeIdString>.opcz" instance next to
+ * the file that serves its compressed form.
+ *
+ * "dedup" keeps the content in the chunk store of the catalog (see
+ * file_store.h) and the file as its manifest, so files with equal content
+ * or equal parts share the space. The "store" line naming the store
+ * directory must come first; it should not lie inside a "tree" directory.
+ * Loading reads the manifest of every dedup entry.
+ *
+ * "groupcommit" collects the commits of Close for the given time and makes
+ * them durable together, with one sync per file system (see
+ * fileCommitSetGroupWindow). 0, the default, commits every file on its own.
+ *
+ * A "vdir" line adds a virtual folder "<NodeIdPrefix>" instead, whatever the
+ * number of files in the directory. Its file nodes exist only while in use:
+ * the folder method GetFile(name) adds the FileType node of a file on demand
+ * and returns its NodeId, ListFiles() returns the file names. Nodes without
+ * open handles are removed again after FILECATALOG_IDLE_TIMEOUT.
+ *
+ * A "tree" line mirrors the directory and its subdirectories as a
+ * FileDirectoryType subtree that follows changes on disk, see
+ * file_directory.h. */
+#define FILECATALOG_IDLE_TIMEOUT (60 * UA_DATETIME_SEC)
+
+typedef struct VirtualFolder VirtualFolder;
+
+typedef struct {
+    FileState **states;
+    size_t statesSize;
+    size_t statesCapacity;
+
+    UA_Server *server;
+    VirtualFolder **folders;
+    size_t foldersSize;
+    UA_UInt64 evictCallbackId;
+
+    FileDirectory **trees;
+    size_t treesSize;
+
+    FileStore *store;     /* chunk store of the dedup entries */
+} FileCatalog;
+
+/* Adds the catalog entries below parentId. Entries that fail are logged and
+ * skipped; only an unreadable catalog file is an error. */
+UA_StatusCode fileCatalogLoad(UA_Server *server, UA_NodeId parentId,
+                              const char *catalogPath, FileCatalog *catalog);
+
+/* Removes the virtual folder and tree callbacks, clears and frees all states */
+void fileCatalogClear(FileCatalog *catalog);
+
+#endif
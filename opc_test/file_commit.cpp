@@ -0,0 +1,495 @@
+#include "file_commit.h"
+#include "file_io.h"
+#include "file_compress.h"
+#include "file_store.h"
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Batches are serialized among themselves under this I/O key */
+#define GROUP_COMMIT_KEY "<group commit>"
+
+typedef struct {
+    UA_Server *server;
+    int   fd;
+    char  tmpPath[PATH_MAX];
+    char  persistPath[PATH_MAX];
+    FileBuffer content;    /* saved to fd first, owned by the job */
+    UA_Boolean buffered;   /* content holds the data, fd is still empty */
+    UA_Boolean compress;   /* store in the block format */
+    FileStore *store;      /* store the content as chunks, the file as manifest */
+    UA_Boolean grouped;    /* sync and rename happen in a batch */
+    UA_Boolean inPlace;    /* appended file, nothing to rename */
+    struct CommitBatch *group; /* explicit group it belongs to, see fileCommitGroupBegin */
+    UA_StatusCode result;
+    FileCommitDone done;
+    void *context;
+} CommitJob;
+
+typedef struct CommitBatch {
+    CommitJob **jobs;
+    size_t jobsSize;
+
+    /* Explicit groups: written jobs wait until all of the group are */
+    UA_Boolean atomic;     /* explicit group: renamed all together or none */
+    size_t unwritten;
+    UA_Boolean open;
+    UA_Boolean failed;
+    FileCommitDone done;   /* explicit group: runs after the done of its jobs */
+    void *context;
+} CommitBatch;
+
+static UA_Double groupWindowMs = 0.0;
+static CommitBatch pending = {NULL, 0, false, 0, false, false, NULL, NULL};
+static CommitBatch *openGroup = NULL;
+static UA_Boolean flushScheduled = false;
+
+static void dirName(const char *path, char *dir, size_t dirSize) {
+    strncpy(dir, path, dirSize - 1);
+    dir[dirSize - 1] = '\0';
+    char *slash = strrchr(dir, '/');
+    if(slash == dir)
+        slash[1] = '\0';
+    else if(slash)
+        *slash = '\0';
+    else
+        strcpy(dir, ".");
+}
+
+/* Makes the rename itself durable */
+static UA_StatusCode syncDir(const char *dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if(fd < 0)
+        return UA_STATUSCODE_BADINTERNALERROR;
+    int r = fsync(fd);
+    close(fd);
+    return (r == 0) ? UA_STATUSCODE_GOOD : UA_STATUSCODE_BADINTERNALERROR;
+}
+
+static UA_StatusCode moveIntoPlace(CommitJob *c) {
+    int r = close(c->fd);
+    c->fd = -1;
+    if(r != 0 || rename(c->tmpPath, c->persistPath) != 0) {
+        unlink(c->tmpPath);
+        return UA_STATUSCODE_BADINTERNALERROR;
+    }
+    return UA_STATUSCODE_GOOD;
+}
+
+static void discard(CommitJob *c) {
+    if(c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+    if(c->tmpPath[0])
+        unlink(c->tmpPath);
+}
+
+static void finishJob(CommitJob *c) {
+    if(c->store)
+        fileStoreWriteEnd(c->store, c->persistPath, c->result == UA_STATUSCODE_GOOD);
+    if(c->done)
+        c->done(c->context, c->result);
+    free(c);
+}
+
+/* Worker thread: one flush per file system, renames in Close order, then
+ * one fsync per directory */
+static void batchWork(void *data) {
+    CommitBatch *batch = (CommitBatch*)data;
+    size_t count = batch->jobsSize;
+
+    dev_t *synced = (dev_t*)malloc((count ? count : 1) * sizeof(dev_t));
+    size_t syncedSize = 0;
+    for(size_t i = 0; i < count; i++) {
+        CommitJob *c = batch->jobs[i];
+        struct stat st;
+        if(c->result != UA_STATUSCODE_GOOD || batch->failed)
+            continue;
+        if(fstat(c->fd, &st) != 0) {
+            c->result = UA_STATUSCODE_BADINTERNALERROR;
+            continue;
+        }
+        size_t j = 0;
+        while(j < syncedSize && synced[j] != st.st_dev)
+            j++;
+        if(j < syncedSize)
+            continue;
+        if(syncfs(c->fd) != 0) {
+            c->result = UA_STATUSCODE_BADINTERNALERROR; /* next file retries */
+            if(batch->atomic)
+                batch->failed = true;
+        } else if(synced) {
+            synced[syncedSize++] = st.st_dev;
+        }
+    }
+
+    /* An explicit group is moved into place completely or not at all */
+    for(size_t i = 0; i < count && batch->atomic; i++) {
+        if(batch->jobs[i]->result != UA_STATUSCODE_GOOD)
+            batch->failed = true;
+    }
+    for(size_t i = 0; i < count && batch->failed; i++) {
+        if(batch->jobs[i]->result == UA_STATUSCODE_GOOD)
+            batch->jobs[i]->result = UA_STATUSCODE_BADOPERATIONABANDONED;
+    }
+
+    char (*dirs)[PATH_MAX] = (char(*)[PATH_MAX])malloc((count ? count : 1) * PATH_MAX);
+    size_t dirsSize = 0;
+    for(size_t i = 0; i < count; i++) {
+        CommitJob *c = batch->jobs[i];
+        if(c->result != UA_STATUSCODE_GOOD)
+            discard(c);
+        else
+            c->result = moveIntoPlace(c);
+
+        char dir[PATH_MAX];
+        dirName(c->persistPath, dir, sizeof(dir));
+        size_t j = 0;
+        while(j < dirsSize && strcmp(dirs[j], dir) != 0)
+            j++;
+        if(j == dirsSize && dirs)
+            strcpy(dirs[dirsSize++], dir);
+    }
+    for(size_t j = 0; j < dirsSize; j++)
+        syncDir(dirs[j]);
+
+    free(dirs);
+    free(synced);
+}
+
+static void batchComplete(void *data) {
+    CommitBatch *batch = (CommitBatch*)data;
+    UA_StatusCode result = batch->failed ?
+        UA_STATUSCODE_BADOPERATIONABANDONED : UA_STATUSCODE_GOOD;
+    for(size_t i = 0; i < batch->jobsSize; i++) {
+        if(batch->jobs[i]->result != UA_STATUSCODE_GOOD && result == UA_STATUSCODE_GOOD)
+            result = batch->jobs[i]->result;
+        finishJob(batch->jobs[i]);
+    }
+    if(batch->done)
+        batch->done(batch->context, result);
+    free(batch->jobs);
+    free(batch);
+}
+
+/* Hands the pending batch to the I/O workers */
+static void submitBatch(void) {
+    if(pending.jobsSize == 0)
+        return;
+    CommitBatch *batch = (CommitBatch*)malloc(sizeof(CommitBatch));
+    if(!batch) {
+        /* Keep durability: run the batch right here */
+        CommitBatch local = pending;
+        pending.jobs = NULL;
+        pending.jobsSize = 0;
+        batchWork(&local);
+        for(size_t i = 0; i < local.jobsSize; i++)
+            finishJob(local.jobs[i]);
+        free(local.jobs);
+        return;
+    }
+    *batch = pending;
+    pending.jobs = NULL;
+    pending.jobsSize = 0;
+    fileIoSubmit(GROUP_COMMIT_KEY, batchWork, batchComplete, batch);
+}
+
+static void flushCallback(UA_Server*, void*) {
+    flushScheduled = false;
+    submitBatch();
+}
+
+static void enqueueGrouped(CommitJob *c) {
+    CommitJob **jobs = (CommitJob**)realloc(pending.jobs, (pending.jobsSize + 1) * sizeof(CommitJob*));
+    if(!jobs) {
+        discard(c);
+        c->result = UA_STATUSCODE_BADOUTOFMEMORY;
+        finishJob(c);
+        return;
+    }
+    pending.jobs = jobs;
+    pending.jobs[pending.jobsSize++] = c;
+
+    if(!flushScheduled) {
+        UA_DateTime when = UA_DateTime_nowMonotonic() +
+            (UA_DateTime)(groupWindowMs * UA_DATETIME_MSEC);
+        if(UA_Server_addTimedCallback(c->server, flushCallback, NULL, when, NULL) == UA_STATUSCODE_GOOD)
+            flushScheduled = true;
+        else
+            submitBatch();
+    }
+}
+
+static size_t bufferSource(void *context, size_t offset, UA_Byte *dst, size_t length) {
+    return fileBufferRead((const FileBuffer*)context, offset, dst, length);
+}
+
+static size_t fdSource(void *context, size_t offset, UA_Byte *dst, size_t length) {
+    int fd = *(int*)context;
+    size_t done = 0;
+    while(done < length) {
+        ssize_t n = pread(fd, dst + done, length - done, (off_t)(offset + done));
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        done += (size_t)n;
+    }
+    return done;
+}
+
+/* Writes length bytes from source to fd in the format of the job */
+static UA_StatusCode encode(const CommitJob *c, int fd, FileCompressSource source,
+                            void *context, size_t length) {
+    if(c->store)
+        return fileStoreWrite(c->store, fd, source, context, length);
+    return fileCompressWrite(fd, source, context, length);
+}
+
+/* Replaces the plain temporary file of a stream by its encoded form */
+static UA_StatusCode encodeTemp(CommitJob *c) {
+    struct stat st;
+    if(fstat(c->fd, &st) != 0)
+        return UA_STATUSCODE_BADINTERNALERROR;
+    char packedPath[PATH_MAX];
+    int packed = fileCommitCreateTemp(c->persistPath, packedPath, sizeof(packedPath));
+    if(packed < 0)
+        return UA_STATUSCODE_BADINTERNALERROR;
+    UA_StatusCode res = encode(c, packed, fdSource, &c->fd, (size_t)st.st_size);
+    close(c->fd);
+    unlink(c->tmpPath);
+    c->fd = packed;
+    strcpy(c->tmpPath, packedPath);
+    return res;
+}
+
+/* Worker thread: write buffered content, then sync and rename unless batched */
+static void commitWork(void *data) {
+    CommitJob *c = (CommitJob*)data;
+    UA_Boolean encoded = c->compress || c->store;
+    if(c->buffered && encoded)
+        c->result = encode(c, c->fd, bufferSource, &c->content, c->content.length);
+    else if(c->buffered && c->content.length > 0)
+        c->result = fileBufferSave(&c->content, c->fd);
+    else if(encoded && !c->inPlace)
+        c->result = encodeTemp(c);
+    fileBufferClear(&c->content);
+
+    if(c->inPlace) {
+        if(fdatasync(c->fd) != 0)
+            c->result = UA_STATUSCODE_BADINTERNALERROR;
+        close(c->fd);
+        c->fd = -1;
+        return;
+    }
+
+    if(c->result == UA_STATUSCODE_GOOD && !c->grouped) {
+        if(fdatasync(c->fd) != 0) {
+            c->result = UA_STATUSCODE_BADINTERNALERROR;
+        } else {
+            c->result = moveIntoPlace(c);
+            if(c->result == UA_STATUSCODE_GOOD) {
+                char dir[PATH_MAX];
+                dirName(c->persistPath, dir, sizeof(dir));
+                c->result = syncDir(dir);
+            }
+        }
+    }
+    if(c->result != UA_STATUSCODE_GOOD)
+        discard(c);
+}
+
+/* Hands a closed group to the workers once all its jobs are written */
+static void submitGroup(CommitBatch *group) {
+    if(group->open || group->unwritten > 0)
+        return;
+    if(group->jobsSize == 0) {
+        batchComplete(group);
+        return;
+    }
+    fileIoSubmit(GROUP_COMMIT_KEY, batchWork, batchComplete, group);
+}
+
+static void commitComplete(void *data) {
+    CommitJob *c = (CommitJob*)data;
+    if(c->group) {
+        c->group->unwritten--;
+        if(c->result != UA_STATUSCODE_GOOD)
+            c->group->failed = true;
+        submitGroup(c->group);
+        return;
+    }
+    if(c->grouped && c->result == UA_STATUSCODE_GOOD)
+        enqueueGrouped(c);
+    else
+        finishJob(c);
+}
+
+static CommitJob *newJob(UA_Server *server, const char *persistPath,
+                         FileCommitDone done, void *context) {
+    CommitJob *c = (CommitJob*)calloc(1, sizeof(CommitJob));
+    if(!c)
+        return NULL;
+    c->server = server;
+    c->fd = -1;
+    strncpy(c->persistPath, persistPath, sizeof(c->persistPath) - 1);
+    c->grouped = (groupWindowMs > 0.0);
+    c->result = UA_STATUSCODE_GOOD;
+    c->done = done;
+    c->context = context;
+    return c;
+}
+
+/* Call before taking anything over. A job that cannot join fails, and so
+ * does the group: committing it on its own would break the atomicity. */
+static UA_StatusCode joinGroup(CommitJob *c) {
+    if(!openGroup)
+        return UA_STATUSCODE_GOOD;
+    CommitJob **jobs = (CommitJob**)realloc(openGroup->jobs,
+                                            (openGroup->jobsSize + 1) * sizeof(CommitJob*));
+    if(!jobs) {
+        openGroup->failed = true;
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+    }
+    openGroup->jobs = jobs;
+    openGroup->jobs[openGroup->jobsSize++] = c;
+    openGroup->unwritten++;
+    c->group = openGroup;
+    c->grouped = true;
+    return UA_STATUSCODE_GOOD;
+}
+
+int fileCommitCreateTemp(const char *persistPath, char *tmpPath, size_t tmpPathSize) {
+    if((size_t)snprintf(tmpPath, tmpPathSize, "%s.part.XXXXXX", persistPath) >= tmpPathSize)
+        return -1;
+    int fd = mkstemp(tmpPath);
+    if(fd < 0)
+        return fd;
+    /* The replacement keeps the mode and, where permitted, the owner.
+     * Without the right to chown it stays owned by this server. */
+    struct stat st;
+    if(stat(persistPath, &st) == 0) {
+        if((st.st_uid != geteuid() || st.st_gid != getegid()) &&
+           fchown(fd, st.st_uid, st.st_gid) != 0)
+            st.st_mode &= ~(mode_t)(S_ISUID | S_ISGID);
+        fchmod(fd, st.st_mode & 07777);
+    } else {
+        fchmod(fd, 0644);
+    }
+    return fd;
+}
+
+UA_StatusCode fileCommit(UA_Server *server, int fd, const char *tmpPath,
+                         const char *persistPath, UA_Boolean compress, FileStore *store,
+                         FileCommitDone done, void *context) {
+    CommitJob *c = newJob(server, persistPath, done, context);
+    if(!c || joinGroup(c) != UA_STATUSCODE_GOOD) {
+        free(c);
+        close(fd);
+        unlink(tmpPath);
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+    }
+    c->fd = fd;
+    c->compress = compress;
+    c->store = store;
+    if(store)
+        fileStoreWriteBegin(store);
+    strncpy(c->tmpPath, tmpPath, sizeof(c->tmpPath) - 1);
+    fileIoSubmit(c->persistPath, commitWork, commitComplete, c);
+    return UA_STATUSCODE_GOOD;
+}
+
+UA_StatusCode fileCommitAppended(UA_Server *server, int fd, const char *persistPath,
+                                 FileCommitDone done, void *context) {
+    CommitJob *c = newJob(server, persistPath, done, context);
+    if(!c) {
+        close(fd);
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+    }
+    c->fd = fd;
+    c->inPlace = true;
+    c->grouped = false;
+    fileIoSubmit(c->persistPath, commitWork, commitComplete, c);
+    return UA_STATUSCODE_GOOD;
+}
+
+UA_StatusCode fileCommitBuffer(UA_Server *server, FileBuffer *buffer,
+                               const char *persistPath, UA_Boolean compress, FileStore *store,
+                               FileCommitDone done, void *context) {
+    CommitJob *c = newJob(server, persistPath, done, context);
+    if(!c)
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+    c->fd = fileCommitCreateTemp(persistPath, c->tmpPath, sizeof(c->tmpPath));
+    if(c->fd < 0) {
+        free(c);
+        return UA_STATUSCODE_BADINTERNALERROR;
+    }
+    if(joinGroup(c) != UA_STATUSCODE_GOOD) {
+        discard(c);
+        free(c);
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+    }
+    c->content = *buffer;
+    c->buffered = true;
+    c->compress = compress;
+    c->store = store;
+    if(store)
+        fileStoreWriteBegin(store);
+    fileBufferInit(buffer);
+    fileIoSubmit(c->persistPath, commitWork, commitComplete, c);
+    return UA_STATUSCODE_GOOD;
+}
+
+UA_StatusCode fileCommitGroupBegin(void) {
+    if(openGroup)
+        return UA_STATUSCODE_BADINVALIDSTATE;
+    openGroup = (CommitBatch*)calloc(1, sizeof(CommitBatch));
+    if(!openGroup)
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+    openGroup->atomic = true;
+    openGroup->open = true;
+    return UA_STATUSCODE_GOOD;
+}
+
+void fileCommitGroupEnd(UA_Boolean abandon, FileCommitDone done, void *context) {
+    CommitBatch *group = openGroup;
+    if(!group)
+        return;
+    openGroup = NULL;
+    group->open = false;
+    group->done = done;
+    group->context = context;
+    if(abandon)
+        group->failed = true;
+    submitGroup(group);
+}
+
+void fileCommitSetGroupWindow(UA_Double windowMs) {
+    groupWindowMs = windowMs;
+}
+
+static UA_Boolean pendingHolds(const char *persistPath) {
+    for(size_t i = 0; i < pending.jobsSize; i++) {
+        if(strcmp(pending.jobs[i]->persistPath, persistPath) == 0)
+            return true;
+    }
+    return false;
+}
+
+void fileCommitFlush(const char *persistPath) {
+    if(pendingHolds(persistPath))
+        submitBatch();
+}
+
+void fileCommitSync(void) {
+    /* Completions of single commits may add to the batch, loop until quiet */
+    do {
+        submitBatch();
+        fileIoDrain();
+    } while(pending.jobsSize > 0);
+}
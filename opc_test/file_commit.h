@@ -0,0 +1,69 @@
+#ifndef FILE_COMMIT_H
+#define FILE_COMMIT_H
+
+extern "C" {
+#include "open62541.h"
+}
+#include "file_buffer.h"
+#include "file_store.h"
+
+/* Crash-safe replacement of files. New content is written to a temporary
+ * file next to the target, made durable with fdatasync and moved over the
+ * target with rename(), followed by an fsync of the directory. A crash at
+ * any point leaves either the old or the new file, never a truncated one.
+ *
+ * The disk work runs on the file I/O workers (see file_io.h): a commit
+ * returns once it is queued and done runs on the server thread when the
+ * new content is in place. Commits of the same file complete in order.
+ *
+ * With a group commit window set, commits are batched and flushed together
+ * when the window expires: one syncfs per file system instead of one flush
+ * per file.
+ *
+ * With compress set the content is stored in the seekable block format of
+ * file_compress.h; the compression runs on the worker as well. With store
+ * set the content goes into that chunk store (see file_store.h) and the
+ * file becomes its manifest. */
+
+typedef void (*FileCommitDone)(void *context, UA_StatusCode result);
+
+/* Creates and opens "<persistPath>.part.XXXXXX" with the mode and owner of
+ * persistPath, 0644 if it does not exist yet. Returns the descriptor or -1. */
+int fileCommitCreateTemp(const char *persistPath, char *tmpPath, size_t tmpPathSize);
+
+/* Takes over the written temporary file (fd, tmpPath) */
+UA_StatusCode fileCommit(UA_Server *server, int fd, const char *tmpPath,
+                         const char *persistPath, UA_Boolean compress, FileStore *store,
+                         FileCommitDone done, void *context);
+
+/* Takes over the descriptor of a file appended to in place (see
+ * fileStreamOpenAppend): only makes the data durable and closes it */
+UA_StatusCode fileCommitAppended(UA_Server *server, int fd, const char *persistPath,
+                                 FileCommitDone done, void *context);
+
+/* Takes over the content of buffer (left empty) and saves it off-thread */
+UA_StatusCode fileCommitBuffer(UA_Server *server, FileBuffer *buffer,
+                               const char *persistPath, UA_Boolean compress, FileStore *store,
+                               FileCommitDone done, void *context);
+
+/* Explicit group: commits queued between Begin and End are written in
+ * parallel, then flushed and renamed together in one batch (one syncfs per
+ * file system). None of them is renamed unless all were written; the done
+ * of the others then reports BadOperationAbandoned. abandon drops the whole
+ * group, and so does a commit that fails to join it. done (may be NULL) runs
+ * after the done of every job, with Good only if all were renamed. Groups
+ * do not nest. */
+UA_StatusCode fileCommitGroupBegin(void);
+void fileCommitGroupEnd(UA_Boolean abandon, FileCommitDone done, void *context);
+
+/* 0 (default) commits every file on its own */
+void fileCommitSetGroupWindow(UA_Double windowMs);
+
+/* Blocks until every queued commit is in place and its done has run */
+void fileCommitSync(void);
+
+/* Submits a group window holding persistPath right away instead of when
+ * its timer fires. Does not wait. */
+void fileCommitFlush(const char *persistPath);
+
+#endif
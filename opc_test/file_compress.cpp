@@ -0,0 +1,431 @@
+#include "file_compress.h"
+#include "file_cache.h"
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define HEADER_SIZE 8
+#define TRAILER_SIZE 24
+#define MAX_BLOCK_SIZE ((UA_UInt32)16 * 1024 * 1024)
+
+static const UA_Byte magic[4] = {'O', 'P', 'C', 'Z'};
+
+static void putU32(UA_Byte *p, UA_UInt32 v) {
+    for(size_t i = 0; i < 4; i++)
+        p[i] = (UA_Byte)(v >> (8 * i));
+}
+
+static void putU64(UA_Byte *p, UA_UInt64 v) {
+    for(size_t i = 0; i < 8; i++)
+        p[i] = (UA_Byte)(v >> (8 * i));
+}
+
+static UA_UInt32 getU32(const UA_Byte *p) {
+    UA_UInt32 v = 0;
+    for(size_t i = 4; i > 0; i--)
+        v = (v << 8) | p[i - 1];
+    return v;
+}
+
+static UA_UInt64 getU64(const UA_Byte *p) {
+    UA_UInt64 v = 0;
+    for(size_t i = 8; i > 0; i--)
+        v = (v << 8) | p[i - 1];
+    return v;
+}
+
+static UA_StatusCode writeAll(int fd, const UA_Byte *data, size_t length) {
+    while(length > 0) {
+        ssize_t n = write(fd, data, length);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return UA_STATUSCODE_BADINTERNALERROR;
+        data += n;
+        length -= (size_t)n;
+    }
+    return UA_STATUSCODE_GOOD;
+}
+
+static UA_Boolean readAll(int fd, UA_Byte *dst, size_t length, UA_UInt64 offset) {
+    size_t done = 0;
+    while(done < length) {
+        ssize_t n = pread(fd, dst + done, length - done, (off_t)(offset + done));
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        done += (size_t)n;
+    }
+    return true;
+}
+
+/* Produces the format one segment at a time: header, blocks, index */
+typedef struct {
+    UA_Byte *out;
+    size_t outCapacity;
+    size_t outLength;
+    UA_UInt64 *offsets;
+    size_t blocks;
+    size_t offsetsCapacity;
+    UA_UInt64 written;      /* compressed bytes produced so far */
+    UA_UInt64 plainLength;
+} Encoder;
+
+static UA_StatusCode encoderInit(Encoder *e) {
+    memset(e, 0, sizeof(Encoder));
+    e->outCapacity = compressBound((uLong)FILECOMPRESS_BLOCK_SIZE);
+    e->out = (UA_Byte*)malloc(e->outCapacity);
+    return e->out ? UA_STATUSCODE_GOOD : UA_STATUSCODE_BADOUTOFMEMORY;
+}
+
+static void encoderClear(Encoder *e) {
+    free(e->out);
+    free(e->offsets);
+    memset(e, 0, sizeof(Encoder));
+}
+
+static void encodeHeader(Encoder *e) {
+    memcpy(e->out, magic, 4);
+    putU32(e->out + 4, (UA_UInt32)FILECOMPRESS_BLOCK_SIZE);
+    e->outLength = HEADER_SIZE;
+    e->written += HEADER_SIZE;
+}
+
+static UA_StatusCode recordOffset(Encoder *e) {
+    if(e->blocks == e->offsetsCapacity) {
+        size_t capacity = e->offsetsCapacity ? e->offsetsCapacity * 2 : 64;
+        UA_UInt64 *offsets = (UA_UInt64*)realloc(e->offsets, capacity * sizeof(UA_UInt64));
+        if(!offsets)
+            return UA_STATUSCODE_BADOUTOFMEMORY;
+        e->offsets = offsets;
+        e->offsetsCapacity = capacity;
+    }
+    e->offsets[e->blocks] = e->written;
+    return UA_STATUSCODE_GOOD;
+}
+
+static UA_StatusCode encodeBlock(Encoder *e, const UA_Byte *plain, size_t length) {
+    UA_StatusCode res = recordOffset(e);
+    if(res != UA_STATUSCODE_GOOD)
+        return res;
+    uLongf packed = (uLongf)e->outCapacity;
+    if(compress2(e->out, &packed, plain, (uLong)length, FILECOMPRESS_LEVEL) != Z_OK)
+        return UA_STATUSCODE_BADINTERNALERROR;
+    e->blocks++;
+    e->outLength = (size_t)packed;
+    e->written += packed;
+    e->plainLength += length;
+    return UA_STATUSCODE_GOOD;
+}
+
+static UA_StatusCode encodeIndex(Encoder *e) {
+    UA_StatusCode res = recordOffset(e); /* start of the index */
+    if(res != UA_STATUSCODE_GOOD)
+        return res;
+    size_t size = (e->blocks + 1) * 8 + TRAILER_SIZE;
+    if(size > e->outCapacity) {
+        UA_Byte *out = (UA_Byte*)realloc(e->out, size);
+        if(!out)
+            return UA_STATUSCODE_BADOUTOFMEMORY;
+        e->out = out;
+        e->outCapacity = size;
+    }
+    UA_Byte *p = e->out;
+    for(size_t i = 0; i <= e->blocks; i++, p += 8)
+        putU64(p, e->offsets[i]);
+    putU64(p, e->plainLength);
+    putU64(p + 8, (UA_UInt64)e->blocks);
+    memcpy(p + 16, magic, 4);
+    putU32(p + 20, 0);
+    e->outLength = size;
+    e->written += size;
+    return UA_STATUSCODE_GOOD;
+}
+
+UA_StatusCode fileCompressWrite(int fd, FileCompressSource source, void *context, size_t length) {
+    Encoder e;
+    UA_Byte *plain = (UA_Byte*)malloc(FILECOMPRESS_BLOCK_SIZE);
+    UA_StatusCode res = encoderInit(&e);
+    if(!plain || res != UA_STATUSCODE_GOOD) {
+        free(plain);
+        encoderClear(&e);
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+    }
+
+    encodeHeader(&e);
+    res = writeAll(fd, e.out, e.outLength);
+    for(size_t offset = 0; offset < length && res == UA_STATUSCODE_GOOD;) {
+        size_t n = length - offset;
+        if(n > FILECOMPRESS_BLOCK_SIZE)
+            n = FILECOMPRESS_BLOCK_SIZE;
+        if(source(context, offset, plain, n) != n) {
+            res = UA_STATUSCODE_BADINTERNALERROR;
+            break;
+        }
+        res = encodeBlock(&e, plain, n);
+        if(res == UA_STATUSCODE_GOOD)
+            res = writeAll(fd, e.out, e.outLength);
+        offset += n;
+    }
+    if(res == UA_STATUSCODE_GOOD)
+        res = encodeIndex(&e);
+    if(res == UA_STATUSCODE_GOOD)
+        res = writeAll(fd, e.out, e.outLength);
+
+    free(plain);
+    encoderClear(&e);
+    return res;
+}
+
+struct FileDecompressor {
+    int fd;
+    UA_Boolean raw;          /* not in the block format, served as stored */
+    UA_UInt64 plainLength;
+    size_t blockSize;
+    size_t blocks;
+    UA_UInt64 *offsets;
+    UA_Byte *packed;
+    size_t packedCapacity;
+    FileCacheKey key;        /* of the file version, the page is the block */
+    FileCachePage *block;    /* pinned block read last, NULL if none */
+};
+
+/* Reads the index of fd, leaves d->raw set if there is none */
+static UA_StatusCode readIndex(FileDecompressor *d, UA_UInt64 fileSize) {
+    d->raw = true;
+    d->plainLength = fileSize;
+    if(fileSize < HEADER_SIZE + TRAILER_SIZE)
+        return UA_STATUSCODE_GOOD;
+
+    UA_Byte header[HEADER_SIZE], trailer[TRAILER_SIZE];
+    if(!readAll(d->fd, header, HEADER_SIZE, 0) ||
+       !readAll(d->fd, trailer, TRAILER_SIZE, fileSize - TRAILER_SIZE))
+        return UA_STATUSCODE_BADINTERNALERROR;
+    if(memcmp(header, magic, 4) != 0 || memcmp(trailer + 16, magic, 4) != 0)
+        return UA_STATUSCODE_GOOD;
+
+    UA_UInt32 blockSize = getU32(header + 4);
+    UA_UInt64 plainLength = getU64(trailer);
+    UA_UInt64 blocks = getU64(trailer + 8);
+    UA_UInt64 indexSize = (blocks + 1) * 8;
+    if(blockSize == 0 || blockSize > MAX_BLOCK_SIZE ||
+       blocks > fileSize / 8 || indexSize + TRAILER_SIZE > fileSize)
+        return UA_STATUSCODE_BADDECODINGERROR;
+
+    d->offsets = (UA_UInt64*)malloc((size_t)(blocks + 1) * sizeof(UA_UInt64));
+    UA_Byte *index = (UA_Byte*)malloc((size_t)indexSize);
+    if(!d->offsets || !index) {
+        free(index);
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+    }
+    UA_Boolean ok = readAll(d->fd, index, (size_t)indexSize, fileSize - TRAILER_SIZE - indexSize);
+    for(size_t i = 0; ok && i <= blocks; i++) {
+        d->offsets[i] = getU64(index + 8 * i);
+        ok = d->offsets[i] >= HEADER_SIZE && (i == 0 || d->offsets[i] >= d->offsets[i - 1]);
+    }
+    free(index);
+    if(!ok)
+        return UA_STATUSCODE_BADDECODINGERROR;
+
+    d->raw = false;
+    d->plainLength = plainLength;
+    d->blockSize = blockSize;
+    d->blocks = (size_t)blocks;
+    d->packedCapacity = compressBound((uLong)blockSize);
+    d->packed = (UA_Byte*)malloc(d->packedCapacity);
+    if(!d->packed)
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+    return fileCacheFileKey(d->fd, &d->key);
+}
+
+FileDecompressor *fileDecompressorOpen(const char *path) {
+    FileDecompressor *d = (FileDecompressor*)calloc(1, sizeof(FileDecompressor));
+    if(!d)
+        return NULL;
+    d->raw = true;
+    d->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(d->fd < 0) {
+        if(errno == ENOENT)
+            return d; /* empty */
+        free(d);
+        return NULL;
+    }
+    struct stat st;
+    if(fstat(d->fd, &st) != 0 || readIndex(d, (UA_UInt64)st.st_size) != UA_STATUSCODE_GOOD) {
+        fileDecompressorClose(d);
+        return NULL;
+    }
+    return d;
+}
+
+size_t fileDecompressorLength(const FileDecompressor *d) {
+    return (size_t)d->plainLength;
+}
+
+/* Pins block k, inflating it only if no reader of the file has it cached */
+static UA_Boolean loadBlock(FileDecompressor *d, size_t k) {
+    if(d->block && d->block->key.page == k)
+        return true;
+    fileCacheRelease(d->block);
+    d->key.page = k;
+    d->block = fileCacheGet(&d->key);
+    if(d->block)
+        return true;
+
+    UA_UInt64 packedLength = d->offsets[k + 1] - d->offsets[k];
+    if(packedLength > d->packedCapacity || !readAll(d->fd, d->packed, (size_t)packedLength, d->offsets[k]))
+        return false;
+    UA_Byte *plain = (UA_Byte*)malloc(d->blockSize);
+    uLongf plainLength = (uLongf)d->blockSize;
+    if(!plain || uncompress(plain, &plainLength, d->packed, (uLong)packedLength) != Z_OK) {
+        free(plain);
+        return false;
+    }
+    d->block = fileCacheInsert(&d->key, plain, (size_t)plainLength);
+    return d->block != NULL;
+}
+
+size_t fileDecompressorRead(FileDecompressor *d, size_t offset, UA_Byte *dst, size_t length) {
+    if(offset >= d->plainLength)
+        return 0;
+    if(length > d->plainLength - offset)
+        length = (size_t)(d->plainLength - offset);
+
+    if(d->raw) {
+        size_t done = 0;
+        while(done < length) {
+            ssize_t n = pread(d->fd, dst + done, length - done, (off_t)(offset + done));
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0)
+                break;
+            done += (size_t)n;
+        }
+        return done;
+    }
+
+    size_t done = 0;
+    while(done < length) {
+        size_t k = (offset + done) / d->blockSize;
+        size_t inBlock = (offset + done) % d->blockSize;
+        if(k >= d->blocks || !loadBlock(d, k) || inBlock >= d->block->length)
+            break;
+        size_t n = d->block->length - inBlock;
+        if(n > length - done)
+            n = length - done;
+        memcpy(dst + done, d->block->data + inBlock, n);
+        done += n;
+    }
+    return done;
+}
+
+void fileDecompressorPrefetch(const FileDecompressor *d, size_t offset, size_t length) {
+    if(d->fd < 0 || offset >= d->plainLength || length == 0)
+        return;
+    if(length > d->plainLength - offset)
+        length = (size_t)(d->plainLength - offset);
+    if(d->raw) {
+        posix_fadvise(d->fd, (off_t)offset, (off_t)length, POSIX_FADV_WILLNEED);
+        return;
+    }
+    size_t first = offset / d->blockSize;
+    size_t last = (offset + length - 1) / d->blockSize;
+    if(first >= d->blocks)
+        return;
+    if(last >= d->blocks)
+        last = d->blocks - 1;
+    posix_fadvise(d->fd, (off_t)d->offsets[first],
+                  (off_t)(d->offsets[last + 1] - d->offsets[first]), POSIX_FADV_WILLNEED);
+}
+
+void fileDecompressorClose(FileDecompressor *d) {
+    if(!d)
+        return;
+    if(d->fd >= 0)
+        close(d->fd);
+    fileCacheRelease(d->block);
+    free(d->offsets);
+    free(d->packed);
+    free(d);
+}
+
+UA_StatusCode fileCompressedLength(const char *path, UA_UInt64 *length) {
+    FileDecompressor *d = fileDecompressorOpen(path);
+    if(!d)
+        return UA_STATUSCODE_BADINTERNALERROR;
+    *length = d->plainLength;
+    fileDecompressorClose(d);
+    return UA_STATUSCODE_GOOD;
+}
+
+struct FilePacker {
+    const UA_Byte *data;
+    size_t length;
+    size_t consumed;         /* plain bytes encoded */
+    Encoder encoder;
+    size_t outPos;           /* bytes of the current segment handed out */
+    UA_Boolean indexDone;
+};
+
+FilePacker *filePackerNew(const UA_Byte *data, size_t length) {
+    FilePacker *p = (FilePacker*)calloc(1, sizeof(FilePacker));
+    if(!p)
+        return NULL;
+    if(encoderInit(&p->encoder) != UA_STATUSCODE_GOOD) {
+        free(p);
+        return NULL;
+    }
+    p->data = data;
+    p->length = length;
+    encodeHeader(&p->encoder);
+    return p;
+}
+
+size_t filePackerRead(FilePacker *p, UA_Byte *dst, size_t length) {
+    size_t done = 0;
+    while(done < length) {
+        Encoder *e = &p->encoder;
+        if(p->outPos == e->outLength) {
+            /* Current segment is out, produce the next one */
+            UA_StatusCode res;
+            if(p->consumed < p->length) {
+                size_t n = p->length - p->consumed;
+                if(n > FILECOMPRESS_BLOCK_SIZE)
+                    n = FILECOMPRESS_BLOCK_SIZE;
+                res = encodeBlock(e, p->data + p->consumed, n);
+                p->consumed += n;
+            } else if(!p->indexDone) {
+                res = encodeIndex(e);
+                p->indexDone = true;
+            } else {
+                break;
+            }
+            if(res != UA_STATUSCODE_GOOD)
+                break;
+            p->outPos = 0;
+        }
+        size_t n = e->outLength - p->outPos;
+        if(n > length - done)
+            n = length - done;
+        memcpy(dst + done, e->out + p->outPos, n);
+        p->outPos += n;
+        done += n;
+    }
+    return done;
+}
+
+UA_Boolean filePackerDone(const FilePacker *p) {
+    return p->indexDone && p->outPos == p->encoder.outLength;
+}
+
+void filePackerDelete(FilePacker *p) {
+    if(!p)
+        return;
+    encoderClear(&p->encoder);
+    free(p);
+}
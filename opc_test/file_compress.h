@@ -0,0 +1,53 @@
+#ifndef FILE_COMPRESS_H
+#define FILE_COMPRESS_H
+
+extern "C" {
+#include "open62541.h"
+}
+
+/* Seekable compressed format. The plain content is cut into blocks of
+ * FILECOMPRESS_BLOCK_SIZE bytes that are deflated independently, so any
+ * offset can be read by inflating one block:
+ *
+ *   "OPCZ" blockSize:u32 | block 0 | block 1 | ... |
+ *   offset:u64 [blockCount + 1] | plainLength:u64 | blockCount:u64 | "OPCZ" 0:u32
+ *
+ * Integers are little endian, offsets count from the start of the file and
+ * the last one is the start of the index. Writing and packing hold one
+ * block at a time, whatever the file size. */
+#define FILECOMPRESS_BLOCK_SIZE ((size_t)64 * 1024)
+#define FILECOMPRESS_LEVEL 6
+
+/* Copies up to length plain bytes at offset into dst, returns the count */
+typedef size_t (*FileCompressSource)(void *context, size_t offset, UA_Byte *dst, size_t length);
+
+/* Writes length bytes taken from source to fd in the block format */
+UA_StatusCode fileCompressWrite(int fd, FileCompressSource source, void *context, size_t length);
+
+/* Plain length of a stored file. Files that are not in the block format
+ * (yet) count with their size on disk, a missing file is empty. */
+UA_StatusCode fileCompressedLength(const char *path, UA_UInt64 *length);
+
+/* Random access to the plain content of a stored file. Files that are not
+ * in the block format are read as they are. */
+typedef struct FileDecompressor FileDecompressor;
+
+FileDecompressor *fileDecompressorOpen(const char *path);
+size_t fileDecompressorLength(const FileDecompressor *d);
+size_t fileDecompressorRead(FileDecompressor *d, size_t offset, UA_Byte *dst, size_t length);
+/* Starts reading the stored blocks of a plain range in the background */
+void fileDecompressorPrefetch(const FileDecompressor *d, size_t offset, size_t length);
+void fileDecompressorClose(FileDecompressor *d);
+
+/* Produces the block format of data on the fly, for transfers of files
+ * that are stored plain. data must stay valid until the packer is deleted. */
+typedef struct FilePacker FilePacker;
+
+FilePacker *filePackerNew(const UA_Byte *data, size_t length);
+
+/* Copies the next compressed bytes into dst, 0 once everything is out */
+size_t filePackerRead(FilePacker *p, UA_Byte *dst, size_t length);
+UA_Boolean filePackerDone(const FilePacker *p);
+void filePackerDelete(FilePacker *p);
+
+#endif
@@ -0,0 +1,305 @@
+#include "file_delta.h"
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <unordered_map>
+#include <mbedtls/md.h>
+
+#define HEADER_SIZE 16
+#define ENTRY_SIZE (4 + FILEDELTA_STRONG_SIZE)
+#define DEFAULT_BLOCK ((UA_UInt32)4096)
+#define MAX_BLOCKS 16384
+#define MAX_RUN ((UA_UInt64)0xFFFFFFFF)
+
+static const UA_Byte magic[4] = {'O', 'P', 'C', 'S'};
+
+static void putU32(UA_Byte *p, UA_UInt32 v) {
+    for(size_t i = 0; i < 4; i++)
+        p[i] = (UA_Byte)(v >> (8 * i));
+}
+
+static void putU64(UA_Byte *p, UA_UInt64 v) {
+    for(size_t i = 0; i < 8; i++)
+        p[i] = (UA_Byte)(v >> (8 * i));
+}
+
+static UA_UInt32 getU32(const UA_Byte *p) {
+    UA_UInt32 v = 0;
+    for(size_t i = 4; i > 0; i--)
+        v = (v << 8) | p[i - 1];
+    return v;
+}
+
+static UA_UInt64 getU64(const UA_Byte *p) {
+    UA_UInt64 v = 0;
+    for(size_t i = 8; i > 0; i--)
+        v = (v << 8) | p[i - 1];
+    return v;
+}
+
+UA_UInt32 fileDeltaBlockSize(size_t length, UA_UInt32 blockSize) {
+    if(blockSize == 0)
+        blockSize = DEFAULT_BLOCK;
+    if(blockSize < FILEDELTA_MIN_BLOCK)
+        blockSize = FILEDELTA_MIN_BLOCK;
+    /* Requested sizes too: small blocks on a large file only cost memory */
+    while(blockSize < FILEDELTA_MAX_BLOCK && length / blockSize >= MAX_BLOCKS)
+        blockSize *= 2;
+    return (blockSize > FILEDELTA_MAX_BLOCK) ? FILEDELTA_MAX_BLOCK : blockSize;
+}
+
+UA_UInt32 fileDeltaWeak(const UA_Byte *data, size_t length) {
+    UA_UInt32 a = 0, b = 0;
+    for(size_t i = 0; i < length; i++) {
+        a += data[i];
+        b += (UA_UInt32)(length - i) * data[i];
+    }
+    return (a & 0xFFFF) | (b << 16);
+}
+
+UA_StatusCode fileDeltaSignatures(FileCompressSource source, void *context, size_t length,
+                                  UA_UInt32 blockSize, UA_ByteString *signatures) {
+    blockSize = fileDeltaBlockSize(length, blockSize);
+    size_t blocks = (length + blockSize - 1) / blockSize;
+    const mbedtls_md_info_t *sha256 = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+    UA_Byte *block = (UA_Byte*)malloc(blockSize);
+    if(!sha256 || !block ||
+       UA_ByteString_allocBuffer(signatures, HEADER_SIZE + blocks * ENTRY_SIZE) != UA_STATUSCODE_GOOD) {
+        free(block);
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+    }
+
+    UA_Byte *p = signatures->data;
+    memcpy(p, magic, 4);
+    putU32(p + 4, blockSize);
+    putU64(p + 8, (UA_UInt64)length);
+    p += HEADER_SIZE;
+    UA_StatusCode res = UA_STATUSCODE_GOOD;
+    for(size_t k = 0; k < blocks; k++, p += ENTRY_SIZE) {
+        size_t n = (k + 1 < blocks) ? blockSize : length - k * blockSize;
+        UA_Byte digest[32];
+        if(source(context, k * blockSize, block, n) != n ||
+           mbedtls_md(sha256, block, n, digest) != 0) {
+            res = UA_STATUSCODE_BADINTERNALERROR;
+            break;
+        }
+        putU32(p, fileDeltaWeak(block, n));
+        memcpy(p + 4, digest, FILEDELTA_STRONG_SIZE);
+    }
+    free(block);
+    if(res != UA_STATUSCODE_GOOD)
+        UA_ByteString_clear(signatures);
+    return res;
+}
+
+/* Signatures of the old version, blocks by weak checksum */
+typedef struct {
+    UA_UInt32 blockSize;
+    UA_UInt64 length;
+    size_t blocks;
+    const UA_Byte *entries;
+    std::unordered_map<UA_UInt32, std::vector<size_t> > byWeak;
+} SignatureIndex;
+
+static UA_StatusCode indexSignatures(const UA_ByteString *signatures, SignatureIndex *index) {
+    if(signatures->length < HEADER_SIZE || memcmp(signatures->data, magic, 4) != 0)
+        return UA_STATUSCODE_BADDECODINGERROR;
+    index->blockSize = getU32(signatures->data + 4);
+    index->length = getU64(signatures->data + 8);
+    if(index->blockSize < FILEDELTA_MIN_BLOCK || index->blockSize > FILEDELTA_MAX_BLOCK)
+        return UA_STATUSCODE_BADDECODINGERROR;
+    index->blocks = (size_t)((index->length + index->blockSize - 1) / index->blockSize);
+    if(index->blocks > (signatures->length - HEADER_SIZE) / ENTRY_SIZE ||
+       HEADER_SIZE + index->blocks * ENTRY_SIZE != signatures->length)
+        return UA_STATUSCODE_BADDECODINGERROR;
+    index->entries = signatures->data + HEADER_SIZE;
+    for(size_t k = 0; k < index->blocks; k++)
+        index->byWeak[getU32(index->entries + k * ENTRY_SIZE)].push_back(k);
+    return UA_STATUSCODE_GOOD;
+}
+
+static size_t blockLength(const SignatureIndex *index, size_t k) {
+    if(k + 1 < index->blocks)
+        return index->blockSize;
+    return (size_t)(index->length - (UA_UInt64)k * index->blockSize);
+}
+
+/* Collects instructions, merging runs that continue each other */
+typedef struct {
+    std::vector<UA_Byte> out;
+    UA_Byte op;               /* pending run, 0 if none */
+    UA_UInt64 offset;
+    UA_UInt64 length;
+} RecipeWriter;
+
+static void flushRun(RecipeWriter *w) {
+    if(w->op == 0)
+        return;
+    size_t at = w->out.size();
+    w->out.resize(at + 13);
+    w->out[at] = w->op;
+    putU64(&w->out[at + 1], w->offset);
+    putU32(&w->out[at + 9], (UA_UInt32)w->length);
+    w->op = 0;
+}
+
+static void addRun(RecipeWriter *w, UA_Byte op, UA_UInt64 offset, UA_UInt64 length) {
+    if(w->op == op && w->offset + w->length == offset && w->length + length <= MAX_RUN) {
+        w->length += length;
+        return;
+    }
+    flushRun(w);
+    w->op = op;
+    w->offset = offset;
+    w->length = length;
+}
+
+/* Old block at the window, preferring the one after the previous match so
+ * that copies merge. blocks if none. */
+static size_t findBlock(const SignatureIndex *index, const mbedtls_md_info_t *sha256,
+                        UA_UInt32 weak, const UA_Byte *window, size_t windowLength,
+                        size_t preferred) {
+    std::unordered_map<UA_UInt32, std::vector<size_t> >::const_iterator it = index->byWeak.find(weak);
+    if(it == index->byWeak.end())
+        return index->blocks;
+    UA_Byte digest[32];
+    UA_Boolean hashed = false;
+    size_t found = index->blocks;
+    for(size_t i = 0; i < it->second.size(); i++) {
+        size_t k = it->second[i];
+        if(blockLength(index, k) != windowLength)
+            continue;
+        if(!hashed && mbedtls_md(sha256, window, windowLength, digest) != 0)
+            return index->blocks;
+        hashed = true;
+        if(memcmp(index->entries + k * ENTRY_SIZE + 4, digest, FILEDELTA_STRONG_SIZE) != 0)
+            continue;
+        if(k == preferred)
+            return k;
+        if(found == index->blocks)
+            found = k;
+    }
+    return found;
+}
+
+UA_StatusCode fileDeltaMatch(const UA_ByteString *signatures, FileCompressSource source,
+                             void *context, size_t length, UA_ByteString *recipe) {
+    SignatureIndex index;
+    UA_StatusCode res = indexSignatures(signatures, &index);
+    const mbedtls_md_info_t *sha256 = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+    if(res != UA_STATUSCODE_GOOD)
+        return res;
+    if(!sha256)
+        return UA_STATUSCODE_BADINTERNALERROR;
+
+    /* The new version streams through a buffer of a few blocks */
+    size_t B = index.blockSize;
+    std::vector<UA_Byte> buf(4 * B);
+    size_t bufStart = 0, bufLength = 0;
+    RecipeWriter w;
+    w.op = 0;
+
+    /* A window shorter than a block can only match a short last block */
+    size_t shortLength = (size_t)(index.length % B);
+    size_t pos = 0, next = index.blocks;
+    UA_UInt32 a = 0, b = 0;
+    UA_Boolean rolling = false;
+    while(pos < length) {
+        size_t window = (length - pos < B) ? length - pos : B;
+        if(window < B && window != shortLength) {
+            size_t skip = (window > shortLength && shortLength > 0) ? window - shortLength : window;
+            addRun(&w, 'R', pos, skip);
+            pos += skip;
+            rolling = false;
+            continue;
+        }
+        if(pos < bufStart || pos + window > bufStart + bufLength) {
+            /* A skipped tail can leave pos past the buffered bytes */
+            size_t keep = (pos >= bufStart && pos <= bufStart + bufLength) ?
+                bufStart + bufLength - pos : 0;
+            if(keep > 0)
+                memmove(&buf[0], &buf[pos - bufStart], keep);
+            size_t n = length - (pos + keep);
+            if(n > buf.size() - keep)
+                n = buf.size() - keep;
+            if(source(context, pos + keep, &buf[keep], n) != n)
+                return UA_STATUSCODE_BADINTERNALERROR;
+            bufStart = pos;
+            bufLength = keep + n;
+        }
+        const UA_Byte *win = &buf[pos - bufStart];
+        if(!rolling) {
+            UA_UInt32 weak = fileDeltaWeak(win, window);
+            a = weak & 0xFFFF;
+            b = weak >> 16;
+            rolling = true;
+        }
+
+        size_t k = findBlock(&index, sha256, (a & 0xFFFF) | (b << 16), win, window, next);
+        if(k < index.blocks) {
+            addRun(&w, 'C', (UA_UInt64)k * B, window);
+            pos += window;
+            next = k + 1;
+            rolling = false;
+            continue;
+        }
+
+        /* No match: this byte is fetched, the window moves on by one */
+        addRun(&w, 'R', pos, 1);
+        if(window == B && pos + B < bufStart + bufLength) {
+            UA_Byte out = win[0], in = win[B];
+            a = a - out + in;
+            b = b - (UA_UInt32)B * out + a;
+        } else {
+            rolling = false; /* at the tail, or the buffer is refilled first */
+        }
+        pos++;
+    }
+    flushRun(&w);
+
+    if(UA_ByteString_allocBuffer(recipe, w.out.size()) != UA_STATUSCODE_GOOD)
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+    if(!w.out.empty())
+        memcpy(recipe->data, &w.out[0], w.out.size());
+    return UA_STATUSCODE_GOOD;
+}
+
+/* Decodes the instruction at *pos, false if the patch ends inside it */
+static UA_Boolean nextInstruction(const UA_ByteString *patch, size_t *pos,
+                                  FileDeltaInstruction *ins) {
+    size_t left = patch->length - *pos;
+    const UA_Byte *p = patch->data + *pos;
+    memset(ins, 0, sizeof(FileDeltaInstruction));
+    ins->op = p[0];
+    if(ins->op == 'C' && left >= 13) {
+        ins->offset = getU64(p + 1);
+        ins->length = getU32(p + 9);
+        *pos += 13;
+        return true;
+    }
+    if(ins->op == 'D' && left >= 5 && getU32(p + 1) <= left - 5) {
+        ins->length = getU32(p + 1);
+        ins->data = p + 5;
+        *pos += 5 + ins->length;
+        return true;
+    }
+    return false;
+}
+
+UA_StatusCode fileDeltaApply(const UA_ByteString *patch, size_t oldLength,
+                             FileDeltaVisit visit, void *context) {
+    FileDeltaInstruction ins;
+    for(size_t pos = 0; pos < patch->length;) {
+        if(!nextInstruction(patch, &pos, &ins))
+            return UA_STATUSCODE_BADDECODINGERROR;
+        if(ins.op == 'C' && (ins.offset > oldLength || ins.length > oldLength - ins.offset))
+            return UA_STATUSCODE_BADINVALIDARGUMENT;
+    }
+    for(size_t pos = 0; pos < patch->length;) {
+        nextInstruction(patch, &pos, &ins);
+        UA_StatusCode res = visit(context, &ins);
+        if(res != UA_STATUSCODE_GOOD)
+            return res;
+    }
+    return UA_STATUSCODE_GOOD;
+}
@@ -0,0 +1,64 @@
+#ifndef FILE_DELTA_H
+#define FILE_DELTA_H
+
+extern "C" {
+#include "open62541.h"
+}
+#include "file_compress.h"
+
+/* Block signatures and patches for transfers that only move what changed.
+ *
+ * Signatures of a file cut into blocks of blockSize bytes (the last one may
+ * be shorter), for rsync-style matching:
+ *
+ *   "OPCS" blockSize:u32 | length:u64 | (weak:u32 | strong:16 bytes) [blocks]
+ *
+ * weak is the rolling checksum a | b << 16 with a = sum(x[i]) mod 2^16 and
+ * b = sum((n - i) * x[i]) mod 2^16 over the n bytes of the block, strong the
+ * first 16 bytes of the SHA-256 of the block.
+ *
+ * A patch is a sequence of instructions that builds the new version front
+ * to back:
+ *
+ *   'C' offset:u64 length:u32           copy from the old version
+ *   'D' length:u32 data[length]         literal bytes
+ *   'R' offset:u64 length:u32           bytes of the new version at offset,
+ *                                       to be fetched separately
+ *
+ * Integers are little endian. Uploads send 'C' and 'D'; for downloads the
+ * server answers client signatures with 'C' and 'R', and the client reads
+ * only the 'R' ranges. */
+#define FILEDELTA_STRONG_SIZE 16
+#define FILEDELTA_MIN_BLOCK ((UA_UInt32)512)
+#define FILEDELTA_MAX_BLOCK ((UA_UInt32)1024 * 1024)
+
+typedef struct {
+    UA_Byte op;              /* 'C', 'D' or 'R' */
+    UA_UInt64 offset;        /* 'C', 'R' */
+    UA_UInt32 length;
+    const UA_Byte *data;     /* 'D', points into the patch */
+} FileDeltaInstruction;
+
+/* Block size to use for a request of blockSize (0: 4 KiB), grown until the
+ * file has at most 16384 blocks */
+UA_UInt32 fileDeltaBlockSize(size_t length, UA_UInt32 blockSize);
+
+UA_UInt32 fileDeltaWeak(const UA_Byte *data, size_t length);
+
+/* Signatures of length bytes from source */
+UA_StatusCode fileDeltaSignatures(FileCompressSource source, void *context, size_t length,
+                                  UA_UInt32 blockSize, UA_ByteString *signatures);
+
+/* Matches length bytes from source (the new version) against the
+ * signatures of an old version: a copy for every block found, a range for
+ * the bytes in between. */
+UA_StatusCode fileDeltaMatch(const UA_ByteString *signatures, FileCompressSource source,
+                             void *context, size_t length, UA_ByteString *recipe);
+
+/* Calls visit for every instruction of an upload patch ('C' and 'D'). The whole patch is checked
+ * first: nothing is visited if it is malformed or copies beyond oldLength. */
+typedef UA_StatusCode (*FileDeltaVisit)(void *context, const FileDeltaInstruction *ins);
+UA_StatusCode fileDeltaApply(const UA_ByteString *patch, size_t oldLength,
+                             FileDeltaVisit visit, void *context);
+
+#endif
@@ -0,0 +1,94 @@
+#include "file_digest.h"
+#include <cstring>
+#include <cstdlib>
+#include <mbedtls/md.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_CRC32_INSTRUCTION
+#endif
+
+#define CRC32C_POLY 0x82F63B78u /* reflected */
+
+struct FileDigest {
+    mbedtls_md_context_t sha256;
+    UA_UInt32 crc;
+};
+
+/* Filled at static initialization, safe to use from any thread */
+struct Crc32cTable {
+    UA_UInt32 entries[256];
+    Crc32cTable() {
+        for(UA_UInt32 i = 0; i < 256; i++) {
+            UA_UInt32 c = i;
+            for(size_t k = 0; k < 8; k++)
+                c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+            entries[i] = c;
+        }
+    }
+};
+static const Crc32cTable crcTable;
+
+static UA_UInt32 crc32cTable(UA_UInt32 crc, const UA_Byte *data, size_t length) {
+    for(size_t i = 0; i < length; i++)
+        crc = crcTable.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef HAVE_CRC32_INSTRUCTION
+/* Eight bytes per instruction */
+__attribute__((target("sse4.2")))
+static UA_UInt32 crc32cHardware(UA_UInt32 crc, const UA_Byte *data, size_t length) {
+    UA_UInt64 c = crc;
+    for(; length >= 8; data += 8, length -= 8) {
+        UA_UInt64 word;
+        memcpy(&word, data, 8);
+        c = _mm_crc32_u64(c, word);
+    }
+    UA_UInt32 c32 = (UA_UInt32)c;
+    for(; length > 0; data++, length--)
+        c32 = _mm_crc32_u8(c32, *data);
+    return c32;
+}
+#endif
+
+UA_UInt32 fileCrc32c(UA_UInt32 crc, const UA_Byte *data, size_t length) {
+    crc = ~crc;
+#ifdef HAVE_CRC32_INSTRUCTION
+    if(__builtin_cpu_supports("sse4.2"))
+        return ~crc32cHardware(crc, data, length);
+#endif
+    return ~crc32cTable(crc, data, length);
+}
+
+FileDigest *fileDigestNew(void) {
+    FileDigest *d = (FileDigest*)calloc(1, sizeof(FileDigest));
+    if(!d)
+        return NULL;
+    mbedtls_md_init(&d->sha256);
+    if(mbedtls_md_setup(&d->sha256, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0) != 0 ||
+       mbedtls_md_starts(&d->sha256) != 0) {
+        fileDigestDelete(d);
+        return NULL;
+    }
+    return d;
+}
+
+void fileDigestUpdate(FileDigest *d, const UA_Byte *data, size_t length) {
+    mbedtls_md_update(&d->sha256, data, length);
+    d->crc = fileCrc32c(d->crc, data, length);
+}
+
+UA_StatusCode fileDigestFinish(FileDigest *d, UA_Byte sha256[FILEDIGEST_SHA256_SIZE],
+                               UA_UInt32 *crc32c) {
+    if(mbedtls_md_finish(&d->sha256, sha256) != 0)
+        return UA_STATUSCODE_BADINTERNALERROR;
+    *crc32c = d->crc;
+    return UA_STATUSCODE_GOOD;
+}
+
+void fileDigestDelete(FileDigest *d) {
+    if(!d)
+        return;
+    mbedtls_md_free(&d->sha256);
+    free(d);
+}
@@ -0,0 +1,26 @@
+#ifndef FILE_DIGEST_H
+#define FILE_DIGEST_H
+
+extern "C" {
+#include "open62541.h"
+}
+
+/* Streaming checksums of uploaded content: SHA-256 for verification and
+ * CRC32C (Castagnoli) as the fast check. Both are updated with every Write
+ * chunk, so the digest of an upload is ready at Close without reading the
+ * file again. CRC32C uses the SSE4.2 crc32 instruction when the CPU has it. */
+#define FILEDIGEST_SHA256_SIZE 32
+
+typedef struct FileDigest FileDigest;
+
+/* NULL when out of memory */
+FileDigest *fileDigestNew(void);
+void fileDigestUpdate(FileDigest *d, const UA_Byte *data, size_t length);
+UA_StatusCode fileDigestFinish(FileDigest *d, UA_Byte sha256[FILEDIGEST_SHA256_SIZE],
+                               UA_UInt32 *crc32c);
+void fileDigestDelete(FileDigest *d);
+
+/* Continues crc (0 to start) over data */
+UA_UInt32 fileCrc32c(UA_UInt32 crc, const UA_Byte *data, size_t length);
+
+#endif
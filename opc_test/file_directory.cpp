@@ -0,0 +1,319 @@
+#include "file_directory.h"
+#include "file_manager.h"
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <string>
+#include <map>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#define FILEDIRECTORY_POLL_INTERVAL 100 /* ms */
+
+#define FILEDIRECTORY_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                                  IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+                                  IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+enum EntryKind { ENTRY_OTHER, ENTRY_FILE, ENTRY_DIRECTORY };
+
+/* One mirrored directory or file */
+struct DirNode {
+    std::string path;
+    std::string nodeId;
+    EntryKind kind;
+    int wd;                  /* inotify watch of a directory, -1 otherwise */
+    FileState *state;        /* files */
+    std::map<std::string, DirNode*> children;
+};
+
+struct FileDirectory {
+    UA_Server *server;
+    int fd;                  /* inotify instance, non-blocking */
+    UA_Boolean writeThrough;
+    UA_UInt64 callbackId;
+    DirNode *root;
+    std::map<int, DirNode*> watches;
+    std::vector<FileState*> orphans; /* node removed while handles or commits were open */
+};
+
+static const UA_Logger *dirLogger(const FileDirectory *d) {
+    return &UA_Server_getConfig(d->server)->logger;
+}
+
+/* Hidden files and commit temporaries are not mirrored */
+static UA_Boolean mirrored(const char *name) {
+    return name[0] != '.' && !strstr(name, ".part.");
+}
+
+static EntryKind entryKind(const std::string &path, unsigned char type) {
+    if(type == DT_UNKNOWN) {
+        struct stat st;
+        if(lstat(path.c_str(), &st) != 0)
+            return ENTRY_OTHER;
+        if(S_ISDIR(st.st_mode))
+            return ENTRY_DIRECTORY;
+        return S_ISREG(st.st_mode) ? ENTRY_FILE : ENTRY_OTHER;
+    }
+    if(type == DT_DIR)
+        return ENTRY_DIRECTORY;
+    return (type == DT_REG) ? ENTRY_FILE : ENTRY_OTHER;
+}
+
+static void releaseState(FileDirectory *d, FileState *fs) {
+    /* commitDone still refers to the state, and open handles are only
+     * released when their session closes. Free it once both are gone. */
+    if(fs->handlesSize > 0)
+        UA_LOG_INFO(dirLogger(d), UA_LOGCATEGORY_USERLAND,
+                    "%s removed with %u open handles, kept until they close",
+                    fs->persistPath, (unsigned)fs->handlesSize);
+    if(fs->pendingCommits > 0 || fs->handlesSize > 0)
+        d->orphans.push_back(fs);
+    else
+        fileStateDelete(fs);
+}
+
+/* Frees the node and everything below it, the server nodes are left alone */
+static void freeTree(FileDirectory *d, DirNode *node) {
+    for(std::map<std::string, DirNode*>::iterator it = node->children.begin();
+        it != node->children.end(); ++it)
+        freeTree(d, it->second);
+    if(node->wd >= 0) {
+        inotify_rm_watch(d->fd, node->wd);
+        d->watches.erase(node->wd);
+    }
+    if(node->state)
+        releaseState(d, node->state);
+    delete node;
+}
+
+static void removeChild(FileDirectory *d, DirNode *parent, const std::string &name) {
+    std::map<std::string, DirNode*>::iterator it = parent->children.find(name);
+    if(it == parent->children.end())
+        return;
+    DirNode *node = it->second;
+    parent->children.erase(it);
+
+    /* Deleting the object removes the nodes below it as well */
+    UA_Server_deleteNode(d->server, UA_NODEID_STRING(1, (char*)node->nodeId.c_str()), true);
+    freeTree(d, node);
+}
+
+static void watchDirectory(FileDirectory *d, DirNode *node) {
+    node->wd = inotify_add_watch(d->fd, node->path.c_str(), FILEDIRECTORY_WATCH_MASK);
+    if(node->wd < 0) {
+        UA_LOG_WARNING(dirLogger(d), UA_LOGCATEGORY_USERLAND, "Cannot watch %s: %s",
+                       node->path.c_str(), strerror(errno));
+        return;
+    }
+    d->watches[node->wd] = node;
+}
+
+static void addDirectoryObject(FileDirectory *d, UA_NodeId parentId, const char *name,
+                               const DirNode *node) {
+    UA_ObjectAttributes oa = UA_ObjectAttributes_default;
+    oa.displayName = UA_LOCALIZEDTEXT("", (char*)name);
+    UA_Server_addObjectNode(d->server, UA_NODEID_STRING(1, (char*)node->nodeId.c_str()), parentId,
+                            UA_NODEID_NUMERIC(0, UA_NS0ID_HASCOMPONENT),
+                            UA_QUALIFIEDNAME(1, (char*)name),
+                            UA_NODEID_NUMERIC(0, UA_NS0ID_FILEDIRECTORYTYPE),
+                            oa, NULL, NULL);
+}
+
+static void syncDirectory(FileDirectory *d, DirNode *dir);
+
+static void addChild(FileDirectory *d, DirNode *parent, const std::string &name, EntryKind kind) {
+    DirNode *node = new DirNode();
+    node->path = parent->path + "/" + name;
+    node->nodeId = parent->nodeId + "/" + name;
+    node->kind = kind;
+    node->wd = -1;
+    node->state = NULL;
+    UA_NodeId parentId = UA_NODEID_STRING(1, (char*)parent->nodeId.c_str());
+
+    if(kind == ENTRY_FILE) {
+        node->state = fileStateNew(node->path.c_str(), d->writeThrough);
+        if(!node->state) {
+            delete node;
+            return;
+        }
+        if(addFileInstance(d->server, parentId, name.c_str(), node->nodeId.c_str(),
+                           node->state) != UA_STATUSCODE_GOOD) {
+            fileStateDelete(node->state);
+            delete node;
+            return;
+        }
+        parent->children[name] = node;
+        return;
+    }
+
+    /* Watch before scanning, so entries created in between are not missed.
+     * Events for entries the scan already found are ignored. */
+    addDirectoryObject(d, parentId, name.c_str(), node);
+    parent->children[name] = node;
+    watchDirectory(d, node);
+    syncDirectory(d, node);
+}
+
+/* Brings the children of dir in line with the disk. Used for the initial
+ * scan and after an event queue overflow; otherwise events do this. */
+static void syncDirectory(FileDirectory *d, DirNode *dir) {
+    DIR *handle = opendir(dir->path.c_str());
+    std::map<std::string, EntryKind> onDisk;
+    if(handle) {
+        struct dirent *e;
+        while((e = readdir(handle)) != NULL) {
+            if(!mirrored(e->d_name))
+                continue;
+            EntryKind kind = entryKind(dir->path + "/" + e->d_name, e->d_type);
+            if(kind != ENTRY_OTHER)
+                onDisk[e->d_name] = kind;
+        }
+        closedir(handle);
+    }
+
+    std::vector<std::string> gone;
+    for(std::map<std::string, DirNode*>::iterator it = dir->children.begin();
+        it != dir->children.end(); ++it) {
+        std::map<std::string, EntryKind>::iterator found = onDisk.find(it->first);
+        if(found == onDisk.end() || found->second != it->second->kind)
+            gone.push_back(it->first);
+    }
+    for(size_t i = 0; i < gone.size(); i++)
+        removeChild(d, dir, gone[i]);
+
+    for(std::map<std::string, EntryKind>::iterator it = onDisk.begin(); it != onDisk.end(); ++it) {
+        std::map<std::string, DirNode*>::iterator known = dir->children.find(it->first);
+        if(known == dir->children.end())
+            addChild(d, dir, it->first, it->second);
+        else if(known->second->kind == ENTRY_DIRECTORY)
+            syncDirectory(d, known->second);
+        else
+            known->second->state->statValid = false;
+    }
+}
+
+static void handleEvent(FileDirectory *d, const struct inotify_event *ev) {
+    std::map<int, DirNode*>::iterator w = d->watches.find(ev->wd);
+    if(w == d->watches.end())
+        return;
+    DirNode *dir = w->second;
+
+    /* The watched directory itself is gone */
+    if(ev->mask & IN_IGNORED) {
+        d->watches.erase(w);
+        dir->wd = -1;
+        if(dir == d->root) {
+            while(!dir->children.empty())
+                removeChild(d, dir, dir->children.begin()->first);
+        }
+        return;
+    }
+
+    if(ev->len == 0 || !mirrored(ev->name))
+        return;
+    std::string name(ev->name);
+    std::map<std::string, DirNode*>::iterator it = dir->children.find(name);
+
+    if(ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        removeChild(d, dir, name);
+        return;
+    }
+
+    if(ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+        EntryKind kind = entryKind(dir->path + "/" + name, DT_UNKNOWN);
+        if(it != dir->children.end() && it->second->kind != kind) {
+            removeChild(d, dir, name);
+            it = dir->children.end();
+        }
+        if(it == dir->children.end()) {
+            if(kind != ENTRY_OTHER)
+                addChild(d, dir, name, kind);
+            return;
+        }
+    }
+
+    /* Content or permissions changed, e.g. a commit renamed a new version
+     * into place: Size and Writable are read again on their next access */
+    if(it != dir->children.end() && it->second->state)
+        it->second->state->statValid = false;
+}
+
+static void pollEvents(UA_Server*, void *data) {
+    FileDirectory *d = (FileDirectory*)data;
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    UA_Boolean overflow = false;
+    for(;;) {
+        ssize_t n = read(d->fd, buf, sizeof(buf));
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        for(char *p = buf; p < buf + n;) {
+            const struct inotify_event *ev = (const struct inotify_event*)p;
+            if(ev->mask & IN_Q_OVERFLOW)
+                overflow = true;
+            else
+                handleEvent(d, ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+
+    if(overflow) {
+        UA_LOG_WARNING(dirLogger(d), UA_LOGCATEGORY_USERLAND,
+                       "inotify queue overflow, rescanning %s", d->root->path.c_str());
+        syncDirectory(d, d->root);
+    }
+
+    for(size_t i = d->orphans.size(); i > 0; i--) {
+        if(d->orphans[i - 1]->pendingCommits > 0 || d->orphans[i - 1]->handlesSize > 0)
+            continue;
+        fileStateDelete(d->orphans[i - 1]);
+        d->orphans.erase(d->orphans.begin() + (long)(i - 1));
+    }
+}
+
+FileDirectory *fileDirectoryAdd(UA_Server *server, UA_NodeId parentId,
+                                const char *nodeIdPrefix, const char *hostPath,
+                                UA_Boolean writeThrough) {
+    FileDirectory *d = new FileDirectory();
+    d->server = server;
+    d->writeThrough = writeThrough;
+    d->callbackId = 0;
+    d->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(d->fd < 0) {
+        UA_LOG_ERROR(dirLogger(d), UA_LOGCATEGORY_USERLAND, "inotify_init1 failed: %s",
+                     strerror(errno));
+        delete d;
+        return NULL;
+    }
+
+    d->root = new DirNode();
+    d->root->path = hostPath;
+    d->root->nodeId = nodeIdPrefix;
+    d->root->kind = ENTRY_DIRECTORY;
+    d->root->wd = -1;
+    d->root->state = NULL;
+    addDirectoryObject(d, parentId, nodeIdPrefix, d->root);
+    watchDirectory(d, d->root);
+    syncDirectory(d, d->root);
+
+    UA_Server_addRepeatedCallback(server, pollEvents, d, FILEDIRECTORY_POLL_INTERVAL,
+                                  &d->callbackId);
+    return d;
+}
+
+void fileDirectoryDelete(FileDirectory *d) {
+    if(!d)
+        return;
+    UA_Server_removeCallback(d->server, d->callbackId);
+    freeTree(d, d->root);
+    for(size_t i = 0; i < d->orphans.size(); i++)
+        fileStateDelete(d->orphans[i]);
+    close(d->fd);
+    delete d;
+}
@@ -0,0 +1,23 @@
+#ifndef FILE_DIRECTORY_H
+#define FILE_DIRECTORY_H
+
+extern "C" {
+#include "open62541.h"
+}
+
+/* A FileDirectoryType subtree mirroring a host directory. Subdirectories
+ * become FileDirectoryType objects, regular files FileType instances, with
+ * the NodeIds "<NodeIdPrefix>/<relative path>". The tree is scanned once;
+ * afterwards inotify events add and remove single nodes. Only when the
+ * kernel event queue overflows is the tree compared against the disk
+ * again. Symbolic links to directories are not followed. */
+typedef struct FileDirectory FileDirectory;
+
+FileDirectory *fileDirectoryAdd(UA_Server *server, UA_NodeId parentId,
+                                const char *nodeIdPrefix, const char *hostPath,
+                                UA_Boolean writeThrough);
+
+/* Stops watching and frees the file states of the tree */
+void fileDirectoryDelete(FileDirectory *dir);
+
+#endif
@@ -0,0 +1,137 @@
+#include "file_io.h"
+#include <cstring>
+#include <string>
+#include <deque>
+#include <vector>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/* Completions are collected here and run on the server thread */
+#define FILEIO_POLL_INTERVAL_MS 10.0
+
+typedef struct {
+    std::string key;
+    FileIoCallback work;
+    FileIoCallback complete;
+    void *job;
+} IoJob;
+
+static std::mutex ioMutex;
+static std::condition_variable ioWake;    /* workers: new job or stop */
+static std::condition_variable ioIdle;    /* drain: a job finished */
+static std::deque<IoJob> queued;
+static std::deque<IoJob> finished;
+static std::set<std::string> busyKeys;
+static std::vector<std::thread> workers;
+static size_t inFlight = 0;
+static bool stopping = false;
+static UA_UInt64 pollCallbackId = 0;
+
+/* First queued job whose key is not being worked on, keeps per-key order */
+static bool takeRunnable(IoJob *out) {
+    for(std::deque<IoJob>::iterator it = queued.begin(); it != queued.end(); ++it) {
+        if(!it->key.empty() && busyKeys.count(it->key))
+            continue;
+        *out = *it;
+        queued.erase(it);
+        if(!out->key.empty())
+            busyKeys.insert(out->key);
+        return true;
+    }
+    return false;
+}
+
+static void workerLoop(void) {
+    std::unique_lock<std::mutex> lock(ioMutex);
+    for(;;) {
+        IoJob job;
+        while(!takeRunnable(&job)) {
+            if(stopping && queued.empty())
+                return;
+            ioWake.wait(lock);
+        }
+
+        lock.unlock();
+        job.work(job.job);
+        lock.lock();
+
+        if(!job.key.empty())
+            busyKeys.erase(job.key);
+        finished.push_back(job);
+        ioWake.notify_all(); /* jobs waiting on this key can go */
+        ioIdle.notify_all();
+    }
+}
+
+static void runCompletions(void) {
+    std::deque<IoJob> done;
+    {
+        std::lock_guard<std::mutex> lock(ioMutex);
+        done.swap(finished);
+    }
+    for(size_t i = 0; i < done.size(); i++) {
+        if(done[i].complete)
+            done[i].complete(done[i].job);
+        std::lock_guard<std::mutex> lock(ioMutex);
+        inFlight--;
+    }
+}
+
+static void pollCompletions(UA_Server*, void*) {
+    runCompletions();
+}
+
+void fileIoStart(UA_Server *server, size_t threads) {
+    stopping = false;
+    for(size_t i = 0; i < threads; i++)
+        workers.push_back(std::thread(workerLoop));
+    UA_Server_addRepeatedCallback(server, pollCompletions, NULL,
+                                  FILEIO_POLL_INTERVAL_MS, &pollCallbackId);
+}
+
+void fileIoStop(UA_Server *server) {
+    {
+        std::lock_guard<std::mutex> lock(ioMutex);
+        stopping = true;
+    }
+    ioWake.notify_all();
+    for(size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+    workers.clear();
+    runCompletions();
+    UA_Server_removeCallback(server, pollCallbackId);
+}
+
+void fileIoSubmit(const char *key, FileIoCallback work, FileIoCallback complete, void *job) {
+    if(workers.empty()) {
+        work(job);
+        if(complete)
+            complete(job);
+        return;
+    }
+
+    IoJob j;
+    j.key = key ? key : "";
+    j.work = work;
+    j.complete = complete;
+    j.job = job;
+    {
+        std::lock_guard<std::mutex> lock(ioMutex);
+        queued.push_back(j);
+        inFlight++;
+    }
+    ioWake.notify_all();
+}
+
+void fileIoDrain(void) {
+    for(;;) {
+        runCompletions();
+        std::unique_lock<std::mutex> lock(ioMutex);
+        if(inFlight == 0)
+            return;
+        if(finished.empty())
+            ioIdle.wait(lock);
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef FILE_IO_H
+#define FILE_IO_H
+
+extern "C" {
+#include "open62541.h"
+}
+
+/* Worker threads for blocking disk I/O (saving, fdatasync, rename), so the
+ * UA_Server_run loop keeps serving other sessions during large saves.
+ *
+ * work runs on a worker thread and may only touch data owned by the job.
+ * complete runs afterwards on the server thread, from a repeated callback.
+ * Jobs with the same key (a file path) run one after another in submission
+ * order; jobs with different keys run in parallel. Without started workers
+ * both run inline at submission. */
+
+typedef void (*FileIoCallback)(void *job);
+
+void fileIoStart(UA_Server *server, size_t threads);
+
+/* Finishes all queued jobs, runs their completions and joins the workers */
+void fileIoStop(UA_Server *server);
+
+void fileIoSubmit(const char *key, FileIoCallback work, FileIoCallback complete, void *job);
+
+/* Blocks the calling (server) thread until every submitted job is done and
+ * its completion has run */
+void fileIoDrain(void);
+
+#endif
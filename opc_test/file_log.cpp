@@ -0,0 +1,143 @@
+#include "file_log.h"
+#include <cstdio>
+#include <cstdarg>
+#include <cstdlib>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+#define FILELOG_SLOTS 1024 /* power of two */
+#define FILELOG_MESSAGE_SIZE 256
+#define FILELOG_DRAIN_INTERVAL_MS 5
+
+typedef struct {
+    std::atomic<size_t> seq;
+    UA_LogLevel level;
+    UA_LogCategory category;
+    char message[FILELOG_MESSAGE_SIZE];
+} LogSlot;
+
+/* Bounded multi-producer ring (sequence numbers per slot), one consumer */
+typedef struct {
+    LogSlot slots[FILELOG_SLOTS];
+    std::atomic<size_t> head;
+    size_t tail;
+    std::atomic<UA_UInt64> dropped;
+    std::atomic<bool> stop;
+    UA_LogLevel minLevel;
+    UA_Logger next;
+    std::thread drainer;
+} LogRing;
+
+static void forward(const UA_Logger *logger, UA_LogLevel level, UA_LogCategory category,
+                    const char *msg, ...) {
+    va_list args;
+    va_start(args, msg);
+    logger->log(logger->context, level, category, msg, args);
+    va_end(args);
+}
+
+static bool drainOnce(LogRing *ring) {
+    bool any = false;
+    for(;;) {
+        LogSlot *slot = &ring->slots[ring->tail & (FILELOG_SLOTS - 1)];
+        if(slot->seq.load(std::memory_order_acquire) != ring->tail + 1)
+            break;
+        if(ring->next.log)
+            forward(&ring->next, slot->level, slot->category, "%s", slot->message);
+        slot->seq.store(ring->tail + FILELOG_SLOTS, std::memory_order_release);
+        ring->tail++;
+        any = true;
+    }
+
+    UA_UInt64 dropped = ring->dropped.exchange(0);
+    if(dropped > 0 && ring->next.log)
+        forward(&ring->next, UA_LOGLEVEL_WARNING, UA_LOGCATEGORY_SERVER,
+                "Log ring full, %llu messages dropped", (unsigned long long)dropped);
+    return any;
+}
+
+static void drainLoop(LogRing *ring) {
+    while(!ring->stop.load()) {
+        if(!drainOnce(ring))
+            std::this_thread::sleep_for(std::chrono::milliseconds(FILELOG_DRAIN_INTERVAL_MS));
+    }
+    drainOnce(ring);
+}
+
+static void ringLog(void *context, UA_LogLevel level, UA_LogCategory category,
+                    const char *msg, va_list args) {
+    LogRing *ring = (LogRing*)context;
+    if(level < ring->minLevel)
+        return;
+
+    size_t pos = ring->head.load(std::memory_order_relaxed);
+    LogSlot *slot;
+    for(;;) {
+        slot = &ring->slots[pos & (FILELOG_SLOTS - 1)];
+        size_t seq = slot->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if(diff == 0) {
+            if(ring->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if(diff < 0) {
+            ring->dropped++;
+            return;
+        } else {
+            pos = ring->head.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->level = level;
+    slot->category = category;
+    vsnprintf(slot->message, FILELOG_MESSAGE_SIZE, msg, args);
+    slot->seq.store(pos + 1, std::memory_order_release);
+}
+
+static void ringClear(void *context) {
+    LogRing *ring = (LogRing*)context;
+    ring->stop.store(true);
+    ring->drainer.join();
+    if(ring->next.clear)
+        ring->next.clear(ring->next.context);
+    delete ring;
+}
+
+void fileLogInstall(UA_Server *server, UA_LogLevel minLevel) {
+    UA_ServerConfig *config = UA_Server_getConfig(server);
+
+    LogRing *ring = new LogRing();
+    for(size_t i = 0; i < FILELOG_SLOTS; i++)
+        ring->slots[i].seq.store(i);
+    ring->head.store(0);
+    ring->tail = 0;
+    ring->dropped.store(0);
+    ring->stop.store(false);
+    ring->minLevel = minLevel;
+    ring->next = config->logger;
+    ring->drainer = std::thread(drainLoop, ring);
+
+    config->logger.log = ringLog;
+    config->logger.context = ring;
+    config->logger.clear = ringClear;
+}
+
+UA_Boolean fileLogAllow(FileLogLimit *limit, UA_UInt32 *suppressed) {
+    UA_DateTime now = UA_DateTime_nowMonotonic();
+    if(limit->last == 0)
+        limit->tokens = limit->burst;
+    else
+        limit->tokens += limit->perSecond * (UA_Double)(now - limit->last) / UA_DATETIME_SEC;
+    if(limit->tokens > limit->burst)
+        limit->tokens = limit->burst;
+    limit->last = now;
+
+    if(limit->tokens < 1.0) {
+        limit->suppressed++;
+        return false;
+    }
+    limit->tokens -= 1.0;
+    *suppressed = limit->suppressed;
+    limit->suppressed = 0;
+    return true;
+}
@@ -0,0 +1,30 @@
+#ifndef FILE_LOG_H
+#define FILE_LOG_H
+
+extern "C" {
+#include "open62541.h"
+}
+
+/* Asynchronous logging for the server. fileLogInstall wraps the configured
+ * logger: messages below minLevel are dropped before formatting, the rest
+ * are formatted into a lock-free ring buffer and written by a background
+ * thread through the original logger, so callers never block on stdout or
+ * the journal. When the ring is full messages are dropped and counted.
+ * Call after the server configuration is complete; UA_Server_delete flushes
+ * and removes it again. */
+void fileLogInstall(UA_Server *server, UA_LogLevel minLevel);
+
+/* Token bucket for periodic messages such as per-transfer summaries */
+typedef struct {
+    UA_Double  perSecond;  /* sustained rate */
+    UA_Double  burst;      /* bucket size */
+    UA_Double  tokens;
+    UA_DateTime last;
+    UA_UInt32  suppressed; /* dropped since the last allowed message */
+} FileLogLimit;
+
+/* True if a message may be logged now. *suppressed receives the number of
+ * messages dropped since the previous allowed one. */
+UA_Boolean fileLogAllow(FileLogLimit *limit, UA_UInt32 *suppressed);
+
+#endif
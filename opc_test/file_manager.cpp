@@ -1,27 +1,510 @@
 #include "file_manager.h"
+#include "file_commit.h"
+#include "file_log.h"
+#include "file_delta.h"
+#include "file_cache.h"
+#include "file_io.h"
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <climits>
+#include <unistd.h>
+#include <sys/stat.h>
 
-static void bindMethod(UA_Server *server, UA_NodeId obj, const char *name, UA_MethodCallback cb) {
-    UA_BrowsePath bp;
-    UA_BrowsePath_init(&bp);
-    bp.startingNode = obj;
-    bp.relativePath.elementsSize = 1;
-    bp.relativePath.elements = (UA_RelativePathElement*)UA_Array_new(1, &UA_TYPES[UA_TYPES_RELATIVEPATHELEMENT]);
-    UA_RelativePathElement_init(&bp.relativePath.elements[0]);
-    bp.relativePath.elements[0].referenceTypeId = UA_NODEID_NUMERIC(0, UA_NS0ID_HASCOMPONENT);
-    bp.relativePath.elements[0].targetName = UA_QUALIFIEDNAME(0, (char*)name);
+/* Adds a FileType property with the NodeId "<object>/<name>" whose value is
+ * answered from FileState instead of being stored. The node starts with a
+ * plain default value so adding it does not invoke the data source. */
+static void addProperty(UA_Server *server, UA_NodeId obj, const char *objIdStr,
+                        UA_UInt16 nsIndex, const char *name, const UA_DataType *type,
+                        UA_DataSource source, FileState *state) {
+    char idStr[PATH_MAX];
+    snprintf(idStr, sizeof(idStr), "%s/%s", objIdStr, name);
+    UA_NodeId propertyId = UA_NODEID_STRING(1, idStr);
 
-    UA_BrowsePathResult r = UA_Server_translateBrowsePathToNodeIds(server, &bp);
-    if(r.statusCode == UA_STATUSCODE_GOOD && r.targetsSize == 1) {
-        UA_Server_setMethodNode_callback(server, r.targets[0].targetId.nodeId, cb);
+    /* All zero bytes are a valid value of every property type */
+    union {
+        UA_UInt64 number;
+        UA_ByteString bytes;
+    } zero;
+    memset(&zero, 0, sizeof(zero));
+    UA_VariableAttributes va = UA_VariableAttributes_default;
+    va.displayName = UA_LOCALIZEDTEXT("", (char*)name);
+    va.dataType = type->typeId;
+    va.valueRank = UA_VALUERANK_SCALAR;
+    UA_Variant_setScalar(&va.value, &zero, type);
+
+    UA_StatusCode res =
+        UA_Server_addVariableNode(server, propertyId, obj,
+                                  UA_NODEID_NUMERIC(0, UA_NS0ID_HASPROPERTY),
+                                  UA_QUALIFIEDNAME(nsIndex, (char*)name),
+                                  UA_NODEID_NUMERIC(0, UA_NS0ID_PROPERTYTYPE),
+                                  va, state, NULL);
+    if(res == UA_STATUSCODE_GOOD)
+        UA_Server_setVariableNode_dataSource(server, propertyId, source);
+}
+
+static UA_Boolean packedCurrent(const FileState *fs, const struct stat *st) {
+    return fs->packedStamp[0] == (UA_UInt64)st->st_size &&
+        fs->packedStamp[1] == (UA_UInt64)st->st_mtim.tv_sec * 1000000000ULL +
+                              (UA_UInt64)st->st_mtim.tv_nsec;
+}
+
+/* Refreshes the cached size and writability from the file system */
+static void statFile(FileState *fs) {
+    struct stat st;
+    fs->statValid = true;
+    fs->statTime = UA_DateTime_nowMonotonic();
+    if(fs->companionOf && !fs->companionOf->compressed) {
+        /* The packed length is known once a transfer completed */
+        fs->writable = false;
+        fs->size = 0;
+        if(stat(fs->persistPath, &st) == 0)
+            fs->size = packedCurrent(fs, &st) ? fs->packedSize : (UA_UInt64)st.st_size;
+        return;
+    }
+    if(stat(fs->persistPath, &st) == 0) {
+        fs->size = (UA_UInt64)st.st_size;
+        UA_UInt64 plainLength;
+        if(fs->compressed && fileCompressedLength(fs->persistPath, &plainLength) == UA_STATUSCODE_GOOD)
+            fs->size = plainLength;
+        else if(fs->store && fileStoreLength(fs->persistPath, &plainLength) == UA_STATUSCODE_GOOD)
+            fs->size = plainLength;
+        fs->writable = !fs->companionOf && (access(fs->persistPath, W_OK) == 0);
+        return;
+    }
+
+    /* Not created yet: writable if its directory is */
+    fs->size = 0;
+    char dir[PATH_MAX];
+    strncpy(dir, fs->persistPath, sizeof(dir) - 1);
+    dir[sizeof(dir) - 1] = '\0';
+    char *slash = strrchr(dir, '/');
+    if(slash)
+        *slash = '\0';
+    fs->writable = !fs->companionOf && (access(slash ? dir : ".", W_OK) == 0);
+}
+
+static UA_StatusCode
+readSize(UA_Server*, const UA_NodeId*, void*, const UA_NodeId*, void *nodeContext,
+         UA_Boolean, const UA_NumericRange*, UA_DataValue *value) {
+    FileState *fs = (FileState*)nodeContext;
+    fs->lastUsed = UA_DateTime_nowMonotonic();
+    if(!fs->statValid || fs->lastUsed - fs->statTime >= FILEMANAGER_STAT_TTL)
+        statFile(fs);
+    UA_Variant_setScalarCopy(&value->value, &fs->size, &UA_TYPES[UA_TYPES_UINT64]);
+    value->hasValue = true;
+    return UA_STATUSCODE_GOOD;
+}
+
+static UA_StatusCode
+readOpenCount(UA_Server*, const UA_NodeId*, void*, const UA_NodeId*, void *nodeContext,
+              UA_Boolean, const UA_NumericRange*, UA_DataValue *value) {
+    FileState *fs = (FileState*)nodeContext;
+    UA_UInt16 openCount = (UA_UInt16)fs->handlesSize;
+    UA_Variant_setScalarCopy(&value->value, &openCount, &UA_TYPES[UA_TYPES_UINT16]);
+    value->hasValue = true;
+    return UA_STATUSCODE_GOOD;
+}
+
+/* No per-user rights exist here, Writable and UserWritable agree */
+static UA_StatusCode
+readWritable(UA_Server*, const UA_NodeId*, void*, const UA_NodeId*, void *nodeContext,
+             UA_Boolean, const UA_NumericRange*, UA_DataValue *value) {
+    FileState *fs = (FileState*)nodeContext;
+    fs->lastUsed = UA_DateTime_nowMonotonic();
+    if(!fs->statValid || fs->lastUsed - fs->statTime >= FILEMANAGER_STAT_TTL)
+        statFile(fs);
+    UA_Variant_setScalarCopy(&value->value, &fs->writable, &UA_TYPES[UA_TYPES_BOOLEAN]);
+    value->hasValue = true;
+    return UA_STATUSCODE_GOOD;
+}
+
+/* Until a front to back upload the checksums are not known */
+static UA_StatusCode
+readSha256(UA_Server*, const UA_NodeId*, void*, const UA_NodeId*, void *nodeContext,
+           UA_Boolean, const UA_NumericRange*, UA_DataValue *value) {
+    FileState *fs = (FileState*)nodeContext;
+    if(!fs->digestValid) {
+        value->hasStatus = true;
+        value->status = UA_STATUSCODE_BADWAITINGFORINITIALDATA;
+        return UA_STATUSCODE_GOOD;
+    }
+    UA_ByteString digest = {FILEDIGEST_SHA256_SIZE, fs->sha256};
+    UA_Variant_setScalarCopy(&value->value, &digest, &UA_TYPES[UA_TYPES_BYTESTRING]);
+    value->hasValue = true;
+    return UA_STATUSCODE_GOOD;
+}
+
+static UA_StatusCode
+readCrc32c(UA_Server*, const UA_NodeId*, void*, const UA_NodeId*, void *nodeContext,
+           UA_Boolean, const UA_NumericRange*, UA_DataValue *value) {
+    FileState *fs = (FileState*)nodeContext;
+    if(!fs->digestValid) {
+        value->hasStatus = true;
+        value->status = UA_STATUSCODE_BADWAITINGFORINITIALDATA;
+        return UA_STATUSCODE_GOOD;
+    }
+    UA_Variant_setScalarCopy(&value->value, &fs->crc32c, &UA_TYPES[UA_TYPES_UINT32]);
+    value->hasValue = true;
+    return UA_STATUSCODE_GOOD;
+}
+
+/* Read results may borrow mapped memory. The server encodes them after the
+ * method returns, so the borrowed view keeps a reference to the mapping that
+ * is dropped from a timed callback on the next main loop iteration, once the
+ * response has been sent. */
+typedef struct {
+    UA_ByteString view;
+    FileMapping *mapping;
+    UA_ByteString *views;  /* ReadRanges, allocated behind the struct */
+} DeferredRelease;
+
+static void releaseDeferred(UA_Server*, void *data) {
+    DeferredRelease *d = (DeferredRelease*)data;
+    fileMappingRelease(d->mapping);
+    free(d);
+}
+
+/* Keeps m alive until the response is out, with room for views */
+static DeferredRelease *deferRelease(UA_Server *server, FileMapping *m, size_t views) {
+    DeferredRelease *d = (DeferredRelease*)calloc(1, sizeof(DeferredRelease) +
+                                                     views * sizeof(UA_ByteString));
+    if(!d)
+        return NULL;
+    if(UA_Server_addTimedCallback(server, releaseDeferred, d,
+                                  UA_DateTime_nowMonotonic(), NULL) != UA_STATUSCODE_GOOD) {
+        free(d);
+        return NULL;
+    }
+    fileMappingRetain(m);
+    d->mapping = m;
+    d->views = (UA_ByteString*)(d + 1);
+    return d;
+}
+
+/* Points into the server config, so it follows fileLogInstall */
+static const UA_Logger *fileLogger = NULL;
+
+/* Close summaries: 10 per second sustained, bursts of 20 */
+static FileLogLimit summaryLimit = {10.0, 20.0, 0.0, 0, 0};
+
+/* FileStates with open handles are looked up when a session goes away */
+static FileState **registeredStates = NULL;
+static size_t registeredStatesSize = 0;
+static size_t registeredStatesCapacity = 0;
+static void (*nextCloseSession)(UA_Server*, UA_AccessControl*, const UA_NodeId*, void*) = NULL;
+
+static FileHandle *findHandle(FileState *fs, const UA_NodeId *sessionId, UA_UInt32 id) {
+    for(size_t i = 0; i < fs->handlesSize; i++) {
+        FileHandle *h = fs->handles[i];
+        if(h->id == id && UA_NodeId_equal(&h->sessionId, sessionId))
+            return h;
+    }
+    return NULL;
+}
+
+static FileHandle *writerHandle(FileState *fs) {
+    for(size_t i = 0; i < fs->handlesSize; i++) {
+        if(fs->handles[i]->openMode & 0x02)
+            return fs->handles[i];
+    }
+    return NULL;
+}
+
+static FileHandle *newHandle(FileState *fs, const UA_NodeId *sessionId, UA_Byte mode) {
+    FileHandle **table = (FileHandle**)realloc(fs->handles, (fs->handlesSize + 1) * sizeof(FileHandle*));
+    if(!table)
+        return NULL;
+    fs->handles = table;
+
+    FileHandle *h = (FileHandle*)calloc(1, sizeof(FileHandle));
+    if(!h)
+        return NULL;
+
+    /* Handle ids are never 0 and not reused while a handle is open */
+    UA_Boolean inUse;
+    do {
+        fs->lastHandle++;
+        inUse = (fs->lastHandle == 0);
+        for(size_t i = 0; i < fs->handlesSize && !inUse; i++)
+            inUse = (fs->handles[i]->id == fs->lastHandle);
+    } while(inUse);
+
+    h->id = fs->lastHandle;
+    h->openMode = mode;
+    fs->lastUsed = UA_DateTime_nowMonotonic();
+    UA_NodeId_copy(sessionId, &h->sessionId);
+    fs->handles[fs->handlesSize++] = h;
+    return h;
+}
+
+static void closeStored(StoredVersion *v);
+
+/* Discards anything not committed and removes the handle from the table */
+static void freeHandle(FileState *fs, FileHandle *h) {
+    for(size_t i = 0; i < fs->handlesSize; i++) {
+        if(fs->handles[i] == h) {
+            fs->handles[i] = fs->handles[--fs->handlesSize];
+            break;
+        }
+    }
+    fileMappingRelease(h->mapping);
+    fileDecompressorClose(h->unpacked);
+    fileStoreReaderClose(h->chunks);
+    filePackerDelete(h->packer);
+    fileDigestDelete(h->digest);
+    closeStored(h->base);
+    fileBufferClear(&h->buffer);
+    fileStreamAbort(&h->stream);
+    UA_NodeId_clear(&h->sessionId);
+    free(h);
+    fs->lastUsed = UA_DateTime_nowMonotonic();
+}
+
+/* Readers share one mapping as long as the file on disk is unchanged */
+static FileMapping *acquireMapping(FileState *fs) {
+    if(fs->mapping && !fileMappingIsCurrent(fs->mapping, fs->persistPath)) {
+        fileMappingRelease(fs->mapping);
+        fs->mapping = NULL;
+    }
+    if(!fs->mapping) {
+        fs->mapping = fileMappingOpen(fs->persistPath);
+        if(!fs->mapping)
+            return NULL;
+        fs->statValid = false; /* another version, stat on the next read */
+    }
+    fileMappingRetain(fs->mapping);
+    return fs->mapping;
+}
+
+/* Tail-follow: a reader that has reached the end of its mapping picks up
+ * what was appended since, so a log can be polled through one open handle
+ * at the cost of the new bytes. A file that was replaced (rotated, or
+ * committed by a writer) or truncated is followed from its start. */
+static void followFile(FileState *fs, FileHandle *h) {
+    if(fileMappingIsCurrent(h->mapping, fs->persistPath))
+        return;
+    FileMapping *m = acquireMapping(fs);
+    if(!m)
+        return;
+    if(m->ino != h->mapping->ino || m->length < h->filePos)
+        h->filePos = 0;
+    fileMappingRelease(h->mapping);
+    h->mapping = m;
+}
+
+static size_t handleLength(const FileHandle *h) {
+    if(h->packer)
+        return h->filePos; /* the end is not known before it is reached */
+    if(h->unpacked)
+        return fileDecompressorLength(h->unpacked);
+    if(h->chunks)
+        return fileStoreReaderLength(h->chunks);
+    if(h->stream.active)
+        return h->stream.length;
+    if(h->mapping)
+        return h->mapping->length;
+    return h->buffer.length;
+}
+
+/* Copies content of a handle, mapped handles included (pread, no SIGBUS) */
+static size_t readAt(FileHandle *h, size_t offset, UA_Byte *dst, size_t length) {
+    if(h->mapping)
+        return fileMappingRead(h->mapping, offset, dst, length);
+    if(h->stream.active)
+        return fileStreamRead(&h->stream, offset, dst, length);
+    if(h->unpacked)
+        return fileDecompressorRead(h->unpacked, offset, dst, length);
+    if(h->chunks)
+        return fileStoreReaderRead(h->chunks, offset, dst, length);
+    fileBufferRead(&h->buffer, offset, dst, length);
+    return length;
+}
+
+static void prefetch(const FileHandle *h, size_t offset, size_t length) {
+    if(h->mapping)
+        fileMappingPrefetch(h->mapping, offset, length);
+    else if(h->unpacked)
+        fileDecompressorPrefetch(h->unpacked, offset, length);
+    else if(h->chunks)
+        fileStoreReaderPrefetch(h->chunks, offset, length);
+}
+
+/* Sequential reads: get the disk reading the window after a Read before the
+ * client asks for it, so the next Read finds the content in memory. The
+ * window is refilled once less than half of it is left. */
+static void readAhead(FileHandle *h, size_t offset, size_t length, size_t fileLength) {
+    size_t end = offset + length;
+    UA_Boolean sequential = (offset == h->lastReadEnd);
+    h->lastReadEnd = end;
+    if(!sequential) {
+        h->readAheadWindow = 0;
+        h->readAheadEnd = end;
+        return;
     }
-    UA_BrowsePathResult_clear(&r);
+    if(h->readAheadWindow > 0 && h->readAheadEnd > end &&
+       h->readAheadEnd - end >= h->readAheadWindow / 2)
+        return;
+
+    size_t window = h->readAheadWindow ? 2 * h->readAheadWindow : FILEMANAGER_READAHEAD_MIN;
+    if(window < 2 * length)
+        window = 2 * length;
+    if(window > FILEMANAGER_READAHEAD_MAX)
+        window = (2 * length > FILEMANAGER_READAHEAD_MAX) ? 2 * length : FILEMANAGER_READAHEAD_MAX;
+    h->readAheadWindow = window;
+
+    size_t from = (h->readAheadEnd > end) ? h->readAheadEnd : end;
+    h->readAheadEnd = end + window;
+    if(from < fileLength)
+        prefetch(h, from, ((h->readAheadEnd < fileLength) ? h->readAheadEnd : fileLength) - from);
+}
+
+static void
+closeSessionHandles(UA_Server *server, UA_AccessControl *ac,
+                    const UA_NodeId *sessionId, void *sessionContext) {
+    for(size_t i = 0; i < registeredStatesSize; i++) {
+        FileState *fs = registeredStates[i];
+        for(size_t j = fs->handlesSize; j > 0; j--) {
+            FileHandle *h = fs->handles[j - 1];
+            if(!UA_NodeId_equal(&h->sessionId, sessionId))
+                continue;
+            UA_LOG_INFO(fileLogger, UA_LOGCATEGORY_USERLAND,
+                        "Session closed, dropping handle %u of %s", h->id, fs->persistPath);
+            freeHandle(fs, h);
+        }
+    }
+    if(nextCloseSession)
+        nextCloseSession(server, ac, sessionId, sessionContext);
+}
+
+/* Plain content of the committed file version, whatever the storage */
+struct StoredVersion {
+    FileMapping *mapping;
+    FileDecompressor *unpacked;
+    FileStoreReader *chunks;
+    size_t length;
+};
+
+static StoredVersion *openStored(FileState *fs) {
+    StoredVersion *v = (StoredVersion*)calloc(1, sizeof(StoredVersion));
+    if(!v)
+        return NULL;
+    if(fs->store) {
+        v->chunks = fileStoreReaderOpen(fs->store, fs->persistPath);
+        if(v->chunks)
+            v->length = fileStoreReaderLength(v->chunks);
+    } else if(fs->compressed) {
+        v->unpacked = fileDecompressorOpen(fs->persistPath);
+        if(v->unpacked)
+            v->length = fileDecompressorLength(v->unpacked);
+    } else {
+        v->mapping = acquireMapping(fs);
+        if(v->mapping)
+            v->length = v->mapping->length;
+    }
+    if(!v->chunks && !v->unpacked && !v->mapping) {
+        free(v);
+        return NULL;
+    }
+    return v;
+}
+
+static void closeStored(StoredVersion *v) {
+    if(!v)
+        return;
+    fileMappingRelease(v->mapping);
+    fileDecompressorClose(v->unpacked);
+    fileStoreReaderClose(v->chunks);
+    free(v);
+}
+
+static size_t storedSource(void *context, size_t offset, UA_Byte *dst, size_t length) {
+    StoredVersion *v = (StoredVersion*)context;
+    if(v->chunks)
+        return fileStoreReaderRead(v->chunks, offset, dst, length);
+    if(v->unpacked)
+        return fileDecompressorRead(v->unpacked, offset, dst, length);
+    if(offset >= v->length)
+        return 0;
+    if(length > v->length - offset)
+        length = v->length - offset;
+    return fileMappingRead(v->mapping, offset, dst, length);
+}
+
+/* Writes at the current position; stored bytes are never moved. Append
+ * handles always write at the end. */
+static UA_StatusCode writeAtPosition(FileState *fs, FileHandle *h, const UA_Byte *data, size_t length) {
+    if(h->stream.append)
+        h->filePos = h->stream.length;
+    if(h->digest && h->filePos != h->digested) {
+        /* Out of order: the streaming checksums cannot cover it */
+        fileDigestDelete(h->digest);
+        h->digest = NULL;
+    }
+    UA_StatusCode res;
+    if(h->stream.active)
+        res = fileStreamWrite(&h->stream, h->filePos, data, length, &fs->stats);
+    else
+        res = fileBufferWrite(&h->buffer, h->filePos, data, length, &fs->stats);
+    if(res != UA_STATUSCODE_GOOD) {
+        UA_LOG_WARNING(fileLogger, UA_LOGCATEGORY_USERLAND, "Write to %s failed: %s",
+                       fs->persistPath, UA_StatusCode_name(res));
+        return res;
+    }
+    if(h->digest) {
+        fileDigestUpdate(h->digest, data, length);
+        h->digested += length;
+    }
+    h->filePos = h->stream.append ? h->stream.length : h->filePos + length;
+    h->bytesWritten += length;
+    h->dirty = true;
+    return UA_STATUSCODE_GOOD;
+}
+
+/* Writes length bytes of v from offset at the current position. Mapped
+ * content is written straight from the mapping unless it was truncated. */
+static UA_StatusCode copyStored(FileState *fs, FileHandle *h, StoredVersion *v,
+                                size_t offset, size_t length) {
+    if(v->mapping && fileMappingIntact(v->mapping))
+        return writeAtPosition(fs, h, v->mapping->data + offset, length);
+
+    UA_Byte *block = (UA_Byte*)malloc(FILECOMPRESS_BLOCK_SIZE);
+    if(!block)
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+    UA_StatusCode res = UA_STATUSCODE_GOOD;
+    for(size_t done = 0; done < length && res == UA_STATUSCODE_GOOD;) {
+        size_t n = length - done;
+        if(n > FILECOMPRESS_BLOCK_SIZE)
+            n = FILECOMPRESS_BLOCK_SIZE;
+        if(storedSource(v, offset + done, block, n) != n) {
+            res = UA_STATUSCODE_BADDECODINGERROR;
+            break;
+        }
+        res = writeAtPosition(fs, h, block, n);
+        done += n;
+    }
+    free(block);
+    return res;
+}
+
+/* Writers of a compressed or chunk-stored file start from its plain content */
+static UA_StatusCode unpackInto(FileState *fs, FileHandle *h) {
+    StoredVersion *v = openStored(fs);
+    if(!v)
+        return UA_STATUSCODE_BADINTERNALERROR;
+    UA_Boolean dirty = h->dirty;
+    UA_StatusCode res = copyStored(fs, h, v, 0, v->length);
+    closeStored(v);
+
+    /* Loading is not writing */
+    h->filePos = 0;
+    h->bytesWritten = 0;
+    h->dirty = dirty;
+    return res;
 }
 
 static UA_StatusCode
-fileOpenMethod(UA_Server*, const UA_NodeId*, void*, const UA_NodeId*, void*,
+fileOpenMethod(UA_Server*, const UA_NodeId *sessionId, void*, const UA_NodeId*, void*,
                const UA_NodeId*, void *objectContext,
                size_t inputSize, const UA_Variant *input, size_t, UA_Variant *output) {
 
@@ -29,154 +512,904 @@ fileOpenMethod(UA_Server*, const UA_NodeId*, void*, const UA_NodeId*, void*,
     if(!fs || inputSize != 1) return UA_STATUSCODE_BADINVALIDARGUMENT;
 
     UA_Byte mode = *(UA_Byte*)input[0].data;
-    if(mode & 0xF8) return UA_STATUSCODE_BADINVALIDARGUMENT;
+    if(mode & 0xF0) return UA_STATUSCODE_BADINVALIDARGUMENT;
+    if((mode & 0x08) && !(mode & 0x02)) return UA_STATUSCODE_BADINVALIDARGUMENT;
+    if((mode & 0x02) && fs->companionOf) return UA_STATUSCODE_BADNOTWRITABLE;
 
-    fs->openMode = mode;
-    fs->isOpen = true;
-    fs->filePos = 0;
+    /* Append: writes go to the end of the file itself, nothing is replaced.
+     * EraseExisting wins over it. */
+    UA_Boolean append = (mode & 0x08) && !(mode & 0x04);
+    UA_Boolean encoded = fs->compressed || fs->store;
+    if(append && encoded)
+        return UA_STATUSCODE_BADNOTSUPPORTED;
 
-    /* EraseExisting logic: Clear memory + file on disk */
-    if(fs->openMode & 0x04) {
-
-        /* clear RAM buffer */
-        if(fs->buffer) {
-            free(fs->buffer);
-            fs->buffer = NULL;
-        }
-        fs->bufferSize = 0;
+    /* Writers are exclusive; readers can share the file with each other.
+     * An appender only excludes other writers: what readers have mapped is
+     * never rewritten, and tail-following readers see the new bytes. */
+    FileHandle *writer = writerHandle(fs);
+    if((mode & 0x02) && (append ? writer != NULL : fs->handlesSize > 0))
+        return UA_STATUSCODE_BADNOTWRITABLE;
+    if(!(mode & 0x02) && writer && !writer->stream.append)
+        return UA_STATUSCODE_BADNOTREADABLE;
 
-        /* truncate file on disk */
-        FILE *f = fopen(fs->persistPath, "wb");
-        if(f) {
-            fclose(f);   /* zero-length file now */
-            printf("Erased existing file: %s\n", fs->persistPath);
-        }
+    /* Read-your-writes: a commit still in flight must land before the file
+     * is opened again. The server thread does not wait for it, the client
+     * retries. */
+    if(fs->pendingCommits > 0) {
+        fileCommitFlush(fs->persistPath);
+        return UA_STATUSCODE_BADRESOURCEUNAVAILABLE;
     }
 
-    if((mode & 0x01)) { /* Read bit */
+    FileHandle *h = newHandle(fs, sessionId, mode);
+    if(!h)
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+
+    /* EraseExisting: start from empty content, the file is replaced at Close */
+    UA_Boolean keepExisting = (mode & 0x01) && !(mode & 0x04);
+    h->dirty = (mode & 0x04) != 0;
+
+    UA_StatusCode res = UA_STATUSCODE_GOOD;
+    if(append) {
+        res = fileStreamOpenAppend(&h->stream, fs->persistPath);
+        h->filePos = h->stream.length;
+    } else if(fs->writeThrough && (mode & 0x02)) {
+        /* Write-through: chunks go to a temporary file, Close renames it */
+        res = fileStreamOpen(&h->stream, fs->persistPath, keepExisting && !encoded);
+        if(res == UA_STATUSCODE_GOOD && keepExisting && encoded)
+            res = unpackInto(fs, h);
+    } else if(!(mode & 0x02) && fs->compressed) {
+        /* Read only, compressed: inflate the blocks that are read */
+        h->unpacked = fileDecompressorOpen(fs->persistPath);
+        if(!h->unpacked)
+            res = UA_STATUSCODE_BADINTERNALERROR;
+    } else if(!(mode & 0x02) && fs->store) {
+        /* Read only, chunk store: read from the shared chunks */
+        h->chunks = fileStoreReaderOpen(fs->store, fs->persistPath);
+        if(!h->chunks)
+            res = UA_STATUSCODE_BADINTERNALERROR;
+    } else if(!(mode & 0x02)) {
+        /* Read only: share the mapping of the current file version */
+        h->mapping = acquireMapping(fs);
+        if(!h->mapping) {
+            res = UA_STATUSCODE_BADINTERNALERROR;
+        } else if(fs->companionOf && !fs->companionOf->compressed) {
+            h->packer = filePackerNew(h->mapping->data, h->mapping->length);
+            if(!h->packer)
+                res = UA_STATUSCODE_BADOUTOFMEMORY;
+        }
+    } else if(keepExisting && encoded) {
+        res = unpackInto(fs, h);
+    } else if(keepExisting) {
         FILE *f = fopen(fs->persistPath, "rb");
         if(f) {
-            fseek(f, 0, SEEK_END);
-            fs->bufferSize = ftell(f);
-            fseek(f, 0, SEEK_SET);
-
-            fs->buffer = (UA_Byte*)malloc(fs->bufferSize);
-            fread(fs->buffer, 1, fs->bufferSize, f);
+            res = fileBufferLoad(&h->buffer, f, &fs->stats);
             fclose(f);
         }
     }
 
+    /* Checksums follow the writes; without memory the upload goes unhashed */
+    if(res == UA_STATUSCODE_GOOD && (mode & 0x02) && !append)
+        h->digest = fileDigestNew();
 
-    UA_UInt32 handle = 1;
-    UA_Variant_setScalarCopy(output, &handle, &UA_TYPES[UA_TYPES_UINT32]);
-    printf("Opened file for: %s\n", fs->persistPath);
+    if(res != UA_STATUSCODE_GOOD) {
+        freeHandle(fs, h);
+        return res;
+    }
+
+    UA_Variant_setScalarCopy(output, &h->id, &UA_TYPES[UA_TYPES_UINT32]);
+    h->openedAt = UA_DateTime_nowMonotonic();
+    UA_LOG_DEBUG(fileLogger, UA_LOGCATEGORY_USERLAND, "Opened %s (handle %u, mode 0x%02x, %u open)",
+                 fs->persistPath, h->id, mode, (unsigned)fs->handlesSize);
     return UA_STATUSCODE_GOOD;
 }
 
 static UA_StatusCode
-fileWriteMethod(UA_Server*, const UA_NodeId*, void*, const UA_NodeId*, void*,
+fileWriteMethod(UA_Server*, const UA_NodeId *sessionId, void*, const UA_NodeId*, void*,
                 const UA_NodeId*, void *objectContext,
                 size_t inputSize, const UA_Variant* input, size_t, UA_Variant*) {
 
     FileState *fs = (FileState*)objectContext;
-    if(!fs || !fs->isOpen || inputSize != 2) return UA_STATUSCODE_BADINVALIDSTATE;
-    if(!(fs->openMode & 0x02)) return UA_STATUSCODE_BADNOTWRITABLE;
+    if(!fs || inputSize != 2) return UA_STATUSCODE_BADINVALIDSTATE;
+
+    FileHandle *h = findHandle(fs, sessionId, *(UA_UInt32*)input[0].data);
+    if(!h) return UA_STATUSCODE_BADINVALIDARGUMENT;
+    if(!(h->openMode & 0x02)) return UA_STATUSCODE_BADNOTWRITABLE;
 
     UA_ByteString *data = (UA_ByteString*)input[1].data;
     if(!data->length) return UA_STATUSCODE_GOOD;
+    return writeAtPosition(fs, h, data->data, data->length);
+}
 
-    /* DYNAMIC ALLOCATION: Resize the buffer to fit new data */
-    size_t newSize = fs->bufferSize + data->length;
-    UA_Byte *newBuffer = (UA_Byte*)realloc(fs->buffer, newSize);
-
-    if(!newBuffer) {
-        printf("Error: Out of memory!\n");
+/* Companion reads: compress the next bytes of the source on the fly */
+static UA_StatusCode readPacked(FileState *fs, FileHandle *h, UA_Int32 length, UA_Variant *output) {
+    /* The packer reads the mapping: the source must not have been truncated */
+    if(!fileMappingIntact(h->mapping))
+        return UA_STATUSCODE_BADINVALIDSTATE;
+    size_t toRead = (length < 0 || (size_t)length > FILEMANAGER_PACKED_READ_MAX) ?
+        FILEMANAGER_PACKED_READ_MAX : (size_t)length;
+    UA_ByteString *data = UA_ByteString_new();
+    if(!data || (toRead > 0 && UA_ByteString_allocBuffer(data, toRead) != UA_STATUSCODE_GOOD)) {
+        UA_ByteString_delete(data);
         return UA_STATUSCODE_BADOUTOFMEMORY;
     }
-
-    fs->buffer = newBuffer;
-    memcpy(fs->buffer + fs->bufferSize, data->data, data->length);
-    fs->bufferSize = newSize;
-
-    printf("Written %zu bytes to %s\n", data->length, fs->persistPath);
+    data->length = filePackerRead(h->packer, data->data, toRead);
+    h->filePos += data->length;
+    h->bytesRead += data->length;
+    struct stat st;
+    if(filePackerDone(h->packer) && fs->companionOf &&
+       fstat(h->mapping->fd, &st) == 0 && (size_t)st.st_size == h->mapping->length) {
+        /* Packed the version still on disk */
+        fs->packedSize = h->filePos;
+        fs->packedStamp[0] = (UA_UInt64)st.st_size;
+        fs->packedStamp[1] = (UA_UInt64)st.st_mtim.tv_sec * 1000000000ULL +
+                             (UA_UInt64)st.st_mtim.tv_nsec;
+        fs->size = h->filePos;
+        fs->statValid = true;
+        fs->statTime = UA_DateTime_nowMonotonic();
+    }
+    UA_Variant_setScalar(output, data, &UA_TYPES[UA_TYPES_BYTESTRING]);
     return UA_STATUSCODE_GOOD;
 }
 
-
 static UA_StatusCode
-fileReadMethod(UA_Server*, const UA_NodeId*, void*, const UA_NodeId*, void*,
+fileReadMethod(UA_Server *server, const UA_NodeId *sessionId, void*, const UA_NodeId*, void*,
                const UA_NodeId*, void *objectContext,
                size_t inputSize, const UA_Variant *input, size_t, UA_Variant *output) {
 
     FileState *fs = (FileState*)objectContext;
-    if(!fs || !fs->isOpen || inputSize != 2)
+    if(!fs || inputSize != 2)
         return UA_STATUSCODE_BADINVALIDSTATE;
 
-    if(!(fs->openMode & 0x01))
+    FileHandle *h = findHandle(fs, sessionId, *(UA_UInt32*)input[0].data);
+    if(!h)
+        return UA_STATUSCODE_BADINVALIDARGUMENT;
+
+    if(!(h->openMode & 0x01))
         return UA_STATUSCODE_BADNOTREADABLE;
 
-    if(!fs->buffer || fs->filePos >= fs->bufferSize) {
+    UA_Int32 length = *(UA_Int32*)input[1].data;
+    if(h->packer)
+        return readPacked(fs, h, length, output);
+
+    /* Follow appends, and truncation in place before the mapping is used */
+    UA_Boolean intact = !h->mapping || fileMappingIntact(h->mapping);
+    if(h->mapping && (h->filePos >= h->mapping->length || !intact)) {
+        followFile(fs, h);
+        intact = fileMappingIntact(h->mapping);
+    }
+
+    size_t fileLength = handleLength(h);
+    if(h->filePos >= fileLength) {
         UA_ByteString empty = UA_BYTESTRING_NULL;
         UA_Variant_setScalarCopy(output, &empty, &UA_TYPES[UA_TYPES_BYTESTRING]);
         return UA_STATUSCODE_GOOD;
     }
 
-    UA_Int32 length = *(UA_Int32*)input[1].data;
-
-    size_t remaining = fs->bufferSize - fs->filePos;
+    size_t remaining = fileLength - h->filePos;
     size_t toRead = (length < 0)
                         ? remaining
                         : (((size_t)length < remaining) ? (size_t)length : remaining);
+    readAhead(h, h->filePos, toRead, fileLength);
 
-    UA_ByteString data;
-    UA_ByteString_allocBuffer(&data, toRead);
-    memcpy(data.data, fs->buffer + fs->filePos, toRead);
-    fs->filePos += toRead;
+    /* Read only: hand the encoder a view into the mapping, no copy at all */
+    if(h->mapping && intact) {
+        DeferredRelease *d = deferRelease(server, h->mapping, 0);
+        if(!d)
+            return UA_STATUSCODE_BADOUTOFMEMORY;
+        d->view.data = (UA_Byte*)h->mapping->data + h->filePos;
+        d->view.length = toRead;
+        h->filePos += toRead;
+        h->bytesRead += toRead;
+        UA_Variant_setScalar(output, &d->view, &UA_TYPES[UA_TYPES_BYTESTRING]);
+        output->storageType = UA_VARIANT_DATA_NODELETE;
+        return UA_STATUSCODE_GOOD;
+    }
 
-    UA_Variant_setScalarCopy(output, &data, &UA_TYPES[UA_TYPES_BYTESTRING]);
-    UA_ByteString_clear(&data);
+    /* Writable content may change before encoding: copy once, hand over ownership */
+    UA_ByteString *data = UA_ByteString_new();
+    if(!data || UA_ByteString_allocBuffer(data, toRead) != UA_STATUSCODE_GOOD) {
+        UA_ByteString_delete(data);
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+    }
+    data->length = readAt(h, h->filePos, data->data, toRead);
+    toRead = data->length;
+    h->filePos += toRead;
+    h->bytesRead += toRead;
+
+    UA_Variant_setScalar(output, data, &UA_TYPES[UA_TYPES_BYTESTRING]);
     return UA_STATUSCODE_GOOD;
 }
 
 
 
+/* Runs when the new content is durable and in place (or failed to get there) */
+static void commitDone(void *context, UA_StatusCode result) {
+    FileState *fs = (FileState*)context;
+    fs->pendingCommits--;
+    if(result != UA_STATUSCODE_GOOD) {
+        fs->digestValid = false;
+        UA_LOG_ERROR(fileLogger, UA_LOGCATEGORY_USERLAND, "Committing %s failed: %s",
+                     fs->persistPath, UA_StatusCode_name(result));
+    } else {
+        /* The checksums describe what is on disk now */
+        fs->digestValid = fs->nextDigestValid;
+        memcpy(fs->sha256, fs->nextSha256, FILEDIGEST_SHA256_SIZE);
+        fs->crc32c = fs->nextCrc32c;
+        UA_LOG_DEBUG(fileLogger, UA_LOGCATEGORY_USERLAND, "Committed %s", fs->persistPath);
+    }
+    statFile(fs);
+}
+
+/* One line per transfer instead of one per chunk, rate limited */
+static void logTransfer(const FileState *fs, const FileHandle *h) {
+    UA_UInt32 suppressed;
+    if(!fileLogAllow(&summaryLimit, &suppressed))
+        return;
+    UA_Double seconds = (UA_Double)(UA_DateTime_nowMonotonic() - h->openedAt) / UA_DATETIME_SEC;
+    UA_UInt64 bytes = h->bytesRead + h->bytesWritten;
+    UA_Double mbps = (seconds > 0.0) ? (UA_Double)bytes / (1024.0 * 1024.0) / seconds : 0.0;
+    FileCacheStats cache;
+    fileCacheGetStats(&cache);
+    UA_LOG_INFO(fileLogger, UA_LOGCATEGORY_USERLAND,
+                "Closed %s (handle %u): read %llu, wrote %llu bytes in %.3f s, %.2f MiB/s "
+                "[%llu chunk allocs, %llu reallocs, %llu bytes copied] "
+                "[page cache %llu hits, %llu misses, %llu evictions, %zu/%zu bytes] "
+                "(%u summaries suppressed)",
+                fs->persistPath, h->id, (unsigned long long)h->bytesRead,
+                (unsigned long long)h->bytesWritten, seconds, mbps,
+                (unsigned long long)fs->stats.chunkAllocs, (unsigned long long)fs->stats.reallocs,
+                (unsigned long long)fs->stats.bytesCopied,
+                (unsigned long long)cache.hits, (unsigned long long)cache.misses,
+                (unsigned long long)cache.evictions, cache.bytes, cache.capacity, suppressed);
+}
+
 static UA_StatusCode
-fileCloseMethod(UA_Server*, const UA_NodeId*, void*, const UA_NodeId*, void*,
-                const UA_NodeId*, void *objectContext, size_t, const UA_Variant*, size_t, UA_Variant*) {
+fileCloseMethod(UA_Server *server, const UA_NodeId *sessionId, void*, const UA_NodeId*, void*,
+                const UA_NodeId*, void *objectContext,
+                size_t inputSize, const UA_Variant *input, size_t, UA_Variant*) {
 
     FileState *fs = (FileState*)objectContext;
-    if(!fs || !fs->isOpen) return UA_STATUSCODE_BADINVALIDSTATE;
+    if(!fs || inputSize != 1) return UA_STATUSCODE_BADINVALIDSTATE;
 
-    fs->isOpen = false;
-    if(fs->buffer && fs->bufferSize > 0) {
-        FILE *f = fopen(fs->persistPath, "wb");
-        if(f) {
-            fwrite(fs->buffer, 1, fs->bufferSize, f);
-            fclose(f);
-            printf("Saved %zu bytes to %s\n", fs->bufferSize, fs->persistPath);
+    FileHandle *h = findHandle(fs, sessionId, *(UA_UInt32*)input[0].data);
+    if(!h) return UA_STATUSCODE_BADINVALIDARGUMENT;
+
+    logTransfer(fs, h);
 
+    /* Readers and unmodified writers: nothing to save */
+    if(!h->dirty) {
+        freeHandle(fs, h);
+        return UA_STATUSCODE_GOOD;
+    }
+
+    /* The new content goes to a temporary file that replaces the original
+     * atomically (append handles excepted). Saving and syncing run on the I/O workers; Close returns
+     * once the commit is queued. */
+    /* The checksums of the upload hold if it covered the whole content */
+    fs->nextDigestValid = h->digest && h->digested == handleLength(h) &&
+        fileDigestFinish(h->digest, fs->nextSha256, &fs->nextCrc32c) == UA_STATUSCODE_GOOD;
+
+    UA_StatusCode res;
+    size_t length;
+    fs->pendingCommits++;
+    if(h->stream.append) {
+        /* Appended in place: only flush and make the new bytes durable */
+        int fd = -1;
+        res = fileStreamFinish(&h->stream, &fd);
+        length = h->stream.length; /* includes appends of other processes */
+        if(res == UA_STATUSCODE_GOOD)
+            res = fileCommitAppended(server, fd, fs->persistPath, commitDone, fs);
+    } else if(h->stream.active) {
+        int fd = -1;
+        char tmpPath[PATH_MAX];
+        length = h->stream.length;
+        strcpy(tmpPath, h->stream.tmpPath);
+        res = fileStreamFinish(&h->stream, &fd);
+        if(res == UA_STATUSCODE_GOOD)
+            res = fileCommit(server, fd, tmpPath, fs->persistPath, fs->compressed, fs->store,
+                             commitDone, fs);
+    } else {
+        length = h->buffer.length;
+        res = fileCommitBuffer(server, &h->buffer, fs->persistPath, fs->compressed, fs->store,
+                               commitDone, fs);
+    }
+
+    if(res != UA_STATUSCODE_GOOD) {
+        fs->pendingCommits--;
+        UA_LOG_ERROR(fileLogger, UA_LOGCATEGORY_USERLAND, "Saving %zu bytes to %s failed: %s",
+                     length, fs->persistPath, UA_StatusCode_name(res));
+    }
+    freeHandle(fs, h);
+    return res;
+}
+
+static UA_StatusCode
+fileGetPositionMethod(UA_Server*, const UA_NodeId *sessionId, void*, const UA_NodeId*, void*,
+                      const UA_NodeId*, void *objectContext,
+                      size_t inputSize, const UA_Variant *input, size_t, UA_Variant *output) {
+
+    FileState *fs = (FileState*)objectContext;
+    if(!fs || inputSize != 1) return UA_STATUSCODE_BADINVALIDSTATE;
+
+    FileHandle *h = findHandle(fs, sessionId, *(UA_UInt32*)input[0].data);
+    if(!h) return UA_STATUSCODE_BADINVALIDARGUMENT;
+
+    UA_UInt64 position = h->filePos;
+    UA_Variant_setScalarCopy(output, &position, &UA_TYPES[UA_TYPES_UINT64]);
+    return UA_STATUSCODE_GOOD;
+}
+
+/* Every backend addresses bytes directly (mapping, chunk arithmetic, pread),
+ * so seeking is O(1) and the next Read/Write starts right there */
+static UA_StatusCode
+fileSetPositionMethod(UA_Server*, const UA_NodeId *sessionId, void*, const UA_NodeId*, void*,
+                      const UA_NodeId*, void *objectContext,
+                      size_t inputSize, const UA_Variant *input, size_t, UA_Variant*) {
+
+    FileState *fs = (FileState*)objectContext;
+    if(!fs || inputSize != 2) return UA_STATUSCODE_BADINVALIDSTATE;
+
+    FileHandle *h = findHandle(fs, sessionId, *(UA_UInt32*)input[0].data);
+    if(!h) return UA_STATUSCODE_BADINVALIDARGUMENT;
+
+    /* Positions past the end are set to the end of the file. Compressing
+     * on the fly only goes forward. */
+    UA_UInt64 position = *(UA_UInt64*)input[1].data;
+    if(h->packer && position != h->filePos)
+        return UA_STATUSCODE_BADNOTSUPPORTED;
+    size_t length = handleLength(h);
+    h->filePos = (position > length) ? length : (size_t)position;
+    return UA_STATUSCODE_GOOD;
+}
+
+/* Several ranges in one Call. The position of the handle does not move.
+ * Ranges beyond the end come back shorter or empty, as with Read. */
+static UA_StatusCode
+readRangesMethod(UA_Server *server, const UA_NodeId *sessionId, void*, const UA_NodeId*, void*,
+                 const UA_NodeId*, void *objectContext,
+                 size_t inputSize, const UA_Variant *input, size_t, UA_Variant *output) {
+    FileState *fs = (FileState*)objectContext;
+    if(!fs || inputSize != 3) return UA_STATUSCODE_BADINVALIDSTATE;
+
+    FileHandle *h = findHandle(fs, sessionId, *(UA_UInt32*)input[0].data);
+    if(!h) return UA_STATUSCODE_BADINVALIDARGUMENT;
+    if(!(h->openMode & 0x01)) return UA_STATUSCODE_BADNOTREADABLE;
+    if(h->packer) return UA_STATUSCODE_BADNOTSUPPORTED;
+
+    size_t count = input[1].arrayLength;
+    if(count != input[2].arrayLength) return UA_STATUSCODE_BADINVALIDARGUMENT;
+    if(count > FILEMANAGER_MAX_RANGES) return UA_STATUSCODE_BADTOOMANYOPERATIONS;
+    const UA_UInt64 *offsets = (const UA_UInt64*)input[1].data;
+    const UA_UInt32 *lengths = (const UA_UInt32*)input[2].data;
+
+    /* Read only handles of a growing file see what was appended, and a
+     * file truncated in place is followed before the mapping is used */
+    UA_Boolean intact = !h->mapping || fileMappingIntact(h->mapping);
+    for(size_t i = 0; h->mapping && i < count; i++) {
+        if(!intact || offsets[i] + lengths[i] > h->mapping->length) {
+            followFile(fs, h);
+            intact = fileMappingIntact(h->mapping);
+            break;
+        }
+    }
+    size_t fileLength = handleLength(h);
+
+    /* Mapped: an array of views into the mapping, no copy at all */
+    if(h->mapping && intact) {
+        DeferredRelease *d = deferRelease(server, h->mapping, count);
+        if(!d)
+            return UA_STATUSCODE_BADOUTOFMEMORY;
+        for(size_t i = 0; i < count; i++) {
+            if(offsets[i] >= fileLength)
+                continue;
+            size_t offset = (size_t)offsets[i];
+            d->views[i].data = (UA_Byte*)h->mapping->data + offset;
+            d->views[i].length = (lengths[i] < fileLength - offset) ? lengths[i] : fileLength - offset;
+            h->bytesRead += d->views[i].length;
+        }
+        UA_Variant_setArray(output, d->views, count, &UA_TYPES[UA_TYPES_BYTESTRING]);
+        output->storageType = UA_VARIANT_DATA_NODELETE;
+        return UA_STATUSCODE_GOOD;
+    }
+
+    UA_ByteString *data = (UA_ByteString*)UA_Array_new(count, &UA_TYPES[UA_TYPES_BYTESTRING]);
+    if(!data && count > 0)
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+    for(size_t i = 0; i < count; i++) {
+        if(offsets[i] >= fileLength)
+            continue;
+        size_t offset = (size_t)offsets[i];
+        size_t length = (lengths[i] < fileLength - offset) ? lengths[i] : fileLength - offset;
+        if(UA_ByteString_allocBuffer(&data[i], length) != UA_STATUSCODE_GOOD) {
+            UA_Array_delete(data, count, &UA_TYPES[UA_TYPES_BYTESTRING]);
+            return UA_STATUSCODE_BADOUTOFMEMORY;
+        }
+        data[i].length = readAt(h, offset, data[i].data, length);
+        h->bytesRead += data[i].length;
+    }
+    UA_Variant_setArray(output, data, count, &UA_TYPES[UA_TYPES_BYTESTRING]);
+    return UA_STATUSCODE_GOOD;
+}
+
+/* GetSignatures and GetMissingRanges of large files run on the I/O
+ * workers. The last request of a file and its result are kept, so calling
+ * again with the same arguments picks the result up, also for later calls
+ * while the file version stays the same. */
+typedef struct DeltaJob {
+    FileState *fs;            /* NULL once the file is gone or asked for something else */
+    UA_Byte op;               /* 'S' signatures, 'M' missing ranges */
+    UA_UInt32 blockSize;      /* 'S', as requested */
+    UA_ByteString signatures; /* 'M', of the client's copy */
+    struct stat version;      /* of the stored file when the job started */
+    StoredVersion *stored;    /* while running */
+    UA_Boolean done;
+    UA_StatusCode result;
+    UA_ByteString output;
+} DeltaJob;
+
+static void deltaJobDelete(DeltaJob *j) {
+    UA_ByteString_clear(&j->signatures);
+    UA_ByteString_clear(&j->output);
+    free(j);
+}
+
+/* Hands the job over to its completion if it is still running */
+static void deltaJobDrop(DeltaJob *j) {
+    if(!j)
+        return;
+    j->fs = NULL;
+    if(j->done)
+        deltaJobDelete(j);
+}
+
+static void deltaWork(void *data) {
+    DeltaJob *j = (DeltaJob*)data;
+    if(j->op == 'S')
+        j->result = fileDeltaSignatures(storedSource, j->stored, j->stored->length,
+                                        j->blockSize, &j->output);
+    else
+        j->result = fileDeltaMatch(&j->signatures, storedSource, j->stored,
+                                   j->stored->length, &j->output);
+}
+
+static void deltaComplete(void *data) {
+    DeltaJob *j = (DeltaJob*)data;
+    closeStored(j->stored);
+    j->stored = NULL;
+    j->done = true;
+    if(!j->fs)
+        deltaJobDelete(j);
+}
+
+static UA_Boolean sameVersion(const struct stat *a, const struct stat *b) {
+    return a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static UA_StatusCode
+deltaRequest(FileState *fs, UA_Byte op, UA_UInt32 blockSize, const UA_ByteString *signatures,
+             UA_Variant *output) {
+    if(fs->companionOf) return UA_STATUSCODE_BADNOTSUPPORTED;
+    fs->lastUsed = UA_DateTime_nowMonotonic();
+
+    /* The committed version, like a reader opened now would see it */
+    if(fs->pendingCommits > 0) {
+        fileCommitFlush(fs->persistPath);
+        return UA_STATUSCODE_BADRESOURCEUNAVAILABLE;
+    }
+    struct stat version;
+    if(stat(fs->persistPath, &version) != 0)
+        memset(&version, 0, sizeof(version));
+
+    DeltaJob *j = fs->delta;
+    UA_Boolean same = j && j->op == op && sameVersion(&j->version, &version) &&
+        (op == 'S' ? j->blockSize == blockSize : UA_ByteString_equal(&j->signatures, signatures));
+    if(!same) {
+        deltaJobDrop(fs->delta);
+        fs->delta = NULL;
+        j = (DeltaJob*)calloc(1, sizeof(DeltaJob));
+        if(!j)
+            return UA_STATUSCODE_BADOUTOFMEMORY;
+        j->fs = fs;
+        j->op = op;
+        j->blockSize = blockSize;
+        j->version = version;
+        j->stored = openStored(fs);
+        if(!j->stored || (op == 'M' && UA_ByteString_copy(signatures, &j->signatures) != UA_STATUSCODE_GOOD)) {
+            closeStored(j->stored);
+            deltaJobDelete(j);
+            return UA_STATUSCODE_BADOUTOFMEMORY;
+        }
+        fs->delta = j;
+
+        /* Small files are answered right away */
+        if(j->stored->length <= FILEMANAGER_DELTA_INLINE) {
+            deltaWork(j);
+            deltaComplete(j);
+        } else {
+            fileIoSubmit(fs->persistPath, deltaWork, deltaComplete, j);
+        }
+    }
+
+    if(!j->done)
+        return UA_STATUSCODE_BADWAITINGFORINITIALDATA;
+    if(j->result != UA_STATUSCODE_GOOD) {
+        /* Not kept, the next call tries again */
+        UA_StatusCode res = j->result;
+        deltaJobDrop(j);
+        fs->delta = NULL;
+        return res;
+    }
+    return UA_Variant_setScalarCopy(output, &j->output, &UA_TYPES[UA_TYPES_BYTESTRING]);
+}
+
+static UA_StatusCode
+getSignaturesMethod(UA_Server*, const UA_NodeId*, void*, const UA_NodeId*, void*,
+                    const UA_NodeId*, void *objectContext,
+                    size_t inputSize, const UA_Variant *input, size_t, UA_Variant *output) {
+    FileState *fs = (FileState*)objectContext;
+    if(!fs || inputSize != 1) return UA_STATUSCODE_BADINVALIDSTATE;
+    return deltaRequest(fs, 'S', *(UA_UInt32*)input[0].data, NULL, output);
+}
+
+/* Download side: which parts of the stored content the client lacks */
+static UA_StatusCode
+getMissingRangesMethod(UA_Server*, const UA_NodeId*, void*, const UA_NodeId*, void*,
+                       const UA_NodeId*, void *objectContext,
+                       size_t inputSize, const UA_Variant *input, size_t, UA_Variant *output) {
+    FileState *fs = (FileState*)objectContext;
+    if(!fs || inputSize != 1) return UA_STATUSCODE_BADINVALIDSTATE;
+    return deltaRequest(fs, 'M', 0, (UA_ByteString*)input[0].data, output);
+}
+
+typedef struct {
+    FileState *fs;
+    FileHandle *h;
+} PatchTarget;
+
+static UA_StatusCode applyInstruction(void *context, const FileDeltaInstruction *ins) {
+    PatchTarget *t = (PatchTarget*)context;
+    if(ins->length == 0)
+        return UA_STATUSCODE_GOOD;
+    if(ins->op == 'D')
+        return writeAtPosition(t->fs, t->h, ins->data, ins->length);
+    return copyStored(t->fs, t->h, t->h->base, (size_t)ins->offset, ins->length);
+}
+
+static UA_StatusCode
+writePatchMethod(UA_Server*, const UA_NodeId *sessionId, void*, const UA_NodeId*, void*,
+                 const UA_NodeId*, void *objectContext,
+                 size_t inputSize, const UA_Variant *input, size_t, UA_Variant*) {
+    FileState *fs = (FileState*)objectContext;
+    if(!fs || inputSize != 2) return UA_STATUSCODE_BADINVALIDSTATE;
+
+    FileHandle *h = findHandle(fs, sessionId, *(UA_UInt32*)input[0].data);
+    if(!h) return UA_STATUSCODE_BADINVALIDARGUMENT;
+    if(!(h->openMode & 0x02)) return UA_STATUSCODE_BADNOTWRITABLE;
+
+    /* Copies refer to the version stored at the first patch. The file is
+     * only replaced at Close, so it stays the same for the whole upload. */
+    if(!h->base) {
+        h->base = openStored(fs);
+        if(!h->base)
+            return UA_STATUSCODE_BADINTERNALERROR;
+    }
+    PatchTarget target = {fs, h};
+    return fileDeltaApply((UA_ByteString*)input[1].data, h->base->length,
+                          applyInstruction, &target);
+}
+
+/* The registered file behind a NodeId, NULL for other nodes */
+static FileState *stateOfNode(UA_Server *server, const UA_NodeId *nodeId) {
+    void *context = NULL;
+    if(UA_Server_getNodeContext(server, *nodeId, &context) != UA_STATUSCODE_GOOD)
+        return NULL;
+    for(size_t i = 0; i < registeredStatesSize; i++) {
+        if(registeredStates[i] == context)
+            return registeredStates[i];
+    }
+    return NULL;
+}
+
+/* Queues the new content of one file, as Close of a buffered writer does */
+static UA_StatusCode queueContent(UA_Server *server, FileState *fs, const UA_ByteString *content) {
+    FileBuffer buffer;
+    fileBufferInit(&buffer);
+    UA_StatusCode res = fileBufferAppend(&buffer, content->data, content->length, &fs->stats);
+    if(res != UA_STATUSCODE_GOOD) {
+        fileBufferClear(&buffer);
+        return res;
+    }
+
+    FileDigest *digest = fileDigestNew();
+    if(digest)
+        fileDigestUpdate(digest, content->data, content->length);
+    fs->nextDigestValid = digest &&
+        fileDigestFinish(digest, fs->nextSha256, &fs->nextCrc32c) == UA_STATUSCODE_GOOD;
+    fileDigestDelete(digest);
+
+    fs->pendingCommits++;
+    res = fileCommitBuffer(server, &buffer, fs->persistPath, fs->compressed, fs->store,
+                           commitDone, fs);
+    if(res != UA_STATUSCODE_GOOD) {
+        fs->pendingCommits--;
+        fileBufferClear(&buffer);
+        UA_LOG_ERROR(fileLogger, UA_LOGCATEGORY_USERLAND, "Saving %zu bytes to %s failed: %s",
+                     content->length, fs->persistPath, UA_StatusCode_name(res));
+    }
+    return res;
+}
+
+/* The results of WriteFiles only say the files were accepted */
+static void groupDone(void*, UA_StatusCode result) {
+    if(result != UA_STATUSCODE_GOOD)
+        UA_LOG_ERROR(fileLogger, UA_LOGCATEGORY_USERLAND, "WriteFiles group failed: %s",
+                     UA_StatusCode_name(result));
+    else
+        UA_LOG_DEBUG(fileLogger, UA_LOGCATEGORY_USERLAND, "WriteFiles group committed");
+}
+
+static UA_StatusCode
+writeFilesMethod(UA_Server *server, const UA_NodeId*, void*, const UA_NodeId*, void*,
+                 const UA_NodeId*, void*,
+                 size_t inputSize, const UA_Variant *input, size_t, UA_Variant *output) {
+    if(inputSize != 2) return UA_STATUSCODE_BADINVALIDSTATE;
+
+    size_t count = input[0].arrayLength;
+    if(count != input[1].arrayLength) return UA_STATUSCODE_BADINVALIDARGUMENT;
+    if(count > FILEMANAGER_MAX_FILES) return UA_STATUSCODE_BADTOOMANYOPERATIONS;
+    const UA_NodeId *files = (const UA_NodeId*)input[0].data;
+    const UA_ByteString *contents = (const UA_ByteString*)input[1].data;
+
+    UA_StatusCode *results = (UA_StatusCode*)UA_Array_new(count, &UA_TYPES[UA_TYPES_STATUSCODE]);
+    FileState **states = (FileState**)calloc(count ? count : 1, sizeof(FileState*));
+    if((!results && count > 0) || !states) {
+        UA_Array_delete(results, count, &UA_TYPES[UA_TYPES_STATUSCODE]);
+        free(states);
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+    }
+
+    /* Check all files first, with the conditions of Open with EraseExisting */
+    UA_Boolean valid = true;
+    for(size_t i = 0; i < count; i++) {
+        states[i] = stateOfNode(server, &files[i]);
+        if(!states[i])
+            results[i] = UA_STATUSCODE_BADNODEIDUNKNOWN;
+        else if(states[i]->companionOf || states[i]->handlesSize > 0)
+            results[i] = UA_STATUSCODE_BADNOTWRITABLE;
+        else if(states[i]->pendingCommits > 0)
+            results[i] = UA_STATUSCODE_BADRESOURCEUNAVAILABLE; /* must not overtake it */
+        for(size_t j = 0; j < i && results[i] == UA_STATUSCODE_GOOD; j++) {
+            if(states[j] == states[i])
+                results[i] = UA_STATUSCODE_BADINVALIDARGUMENT; /* listed twice */
         }
+        if(results[i] != UA_STATUSCODE_GOOD)
+            valid = false;
+    }
+    for(size_t i = 0; !valid && i < count; i++) {
+        if(results[i] == UA_STATUSCODE_BADRESOURCEUNAVAILABLE)
+            fileCommitFlush(states[i]->persistPath); /* for the retry */
     }
 
-    free(fs->buffer);
-    fs->buffer = NULL;
+    /* One commit group: the files are saved in parallel, then flushed with
+     * one sync per file system and renamed together */
+    UA_StatusCode res = UA_STATUSCODE_GOOD;
+    if(valid && count > 0) {
+        res = fileCommitGroupBegin();
+        for(size_t i = 0; res == UA_STATUSCODE_GOOD && i < count; i++) {
+            results[i] = queueContent(server, states[i], &contents[i]);
+            if(results[i] != UA_STATUSCODE_GOOD)
+                valid = false;
+        }
+        if(res == UA_STATUSCODE_GOOD)
+            fileCommitGroupEnd(!valid, valid ? groupDone : NULL, NULL);
+    }
+    free(states);
+    if(res != UA_STATUSCODE_GOOD) {
+        UA_Array_delete(results, count, &UA_TYPES[UA_TYPES_STATUSCODE]);
+        return res;
+    }
 
+    /* Files that were fine but not written because of another one */
+    for(size_t i = 0; !valid && i < count; i++) {
+        if(results[i] == UA_STATUSCODE_GOOD)
+            results[i] = UA_STATUSCODE_BADOPERATIONABANDONED;
+    }
+    UA_LOG_DEBUG(fileLogger, UA_LOGCATEGORY_USERLAND, "WriteFiles: %zu files %s",
+                 count, valid ? "queued" : "rejected");
+    UA_Variant_setArray(output, results, count, &UA_TYPES[UA_TYPES_STATUSCODE]);
     return UA_STATUSCODE_GOOD;
 }
 
-void addFileInstance(UA_Server *server, UA_NodeId parentId, const char* name, const char* nodeIdStr, FileState *state) {
+static UA_Argument scalarArgument(const char *name, const UA_DataType *type) {
+    UA_Argument arg;
+    UA_Argument_init(&arg);
+    arg.name = UA_STRING((char*)name);
+    arg.dataType = type->typeId;
+    arg.valueRank = UA_VALUERANK_SCALAR;
+    return arg;
+}
+
+/* Adds a method to TransferFileType. Mandatory, so instances reference it. */
+static void addTypeMethod(UA_Server *server, const char *name, UA_MethodCallback callback,
+                          size_t inputSize, const UA_Argument *input,
+                          size_t outputSize, const UA_Argument *output) {
+    char nodeIdStr[64];
+    snprintf(nodeIdStr, sizeof(nodeIdStr), "TransferFileType/%s", name);
+    UA_NodeId methodId = UA_NODEID_STRING(1, nodeIdStr);
+    UA_MethodAttributes ma = UA_MethodAttributes_default;
+    ma.displayName = UA_LOCALIZEDTEXT("", (char*)name);
+    ma.executable = true;
+    ma.userExecutable = true;
+    UA_Server_addMethodNode(server, methodId, UA_NODEID_STRING(1, (char*)"TransferFileType"),
+                            UA_NODEID_NUMERIC(0, UA_NS0ID_HASCOMPONENT),
+                            UA_QUALIFIEDNAME(1, (char*)name), ma, callback,
+                            inputSize, input, outputSize, output, NULL, NULL);
+    UA_Server_addReference(server, methodId, UA_NODEID_NUMERIC(0, UA_NS0ID_HASMODELLINGRULE),
+                           UA_EXPANDEDNODEID_NUMERIC(0, UA_NS0ID_MODELLINGRULE_MANDATORY), true);
+}
+
+static void addTransferFileType(UA_Server *server) {
+    UA_ObjectTypeAttributes ta = UA_ObjectTypeAttributes_default;
+    ta.displayName = UA_LOCALIZEDTEXT("", (char*)"TransferFileType");
+    UA_Server_addObjectTypeNode(server, UA_NODEID_STRING(1, (char*)"TransferFileType"),
+                                UA_NODEID_NUMERIC(0, UA_NS0ID_FILETYPE),
+                                UA_NODEID_NUMERIC(0, UA_NS0ID_HASSUBTYPE),
+                                UA_QUALIFIEDNAME(1, (char*)"TransferFileType"), ta, NULL, NULL);
+
+    UA_Argument blockSize = scalarArgument("BlockSize", &UA_TYPES[UA_TYPES_UINT32]);
+    UA_Argument signatures = scalarArgument("Signatures", &UA_TYPES[UA_TYPES_BYTESTRING]);
+    UA_Argument patch[2] = {scalarArgument("FileHandle", &UA_TYPES[UA_TYPES_UINT32]),
+                            scalarArgument("Patch", &UA_TYPES[UA_TYPES_BYTESTRING])};
+    addTypeMethod(server, "GetSignatures", getSignaturesMethod, 1, &blockSize, 1, &signatures);
+    addTypeMethod(server, "WritePatch", writePatchMethod, 2, patch, 0, NULL);
+
+    UA_Argument ranges[3] = {scalarArgument("FileHandle", &UA_TYPES[UA_TYPES_UINT32]),
+                             scalarArgument("Offsets", &UA_TYPES[UA_TYPES_UINT64]),
+                             scalarArgument("Lengths", &UA_TYPES[UA_TYPES_UINT32])};
+    ranges[1].valueRank = UA_VALUERANK_ONE_DIMENSION;
+    ranges[2].valueRank = UA_VALUERANK_ONE_DIMENSION;
+    UA_Argument rangeData = scalarArgument("Data", &UA_TYPES[UA_TYPES_BYTESTRING]);
+    rangeData.valueRank = UA_VALUERANK_ONE_DIMENSION;
+    addTypeMethod(server, "ReadRanges", readRangesMethod, 3, ranges, 1, &rangeData);
+
+    UA_Argument clientSignatures = scalarArgument("Signatures", &UA_TYPES[UA_TYPES_BYTESTRING]);
+    UA_Argument recipe = scalarArgument("Recipe", &UA_TYPES[UA_TYPES_BYTESTRING]);
+    addTypeMethod(server, "GetMissingRanges", getMissingRangesMethod, 1, &clientSignatures, 1, &recipe);
+}
+
+void fileManagerInit(UA_Server *server) {
+    UA_ServerConfig *config = UA_Server_getConfig(server);
+    fileLogger = &config->logger;
+    nextCloseSession = config->accessControl.closeSession;
+    config->accessControl.closeSession = closeSessionHandles;
+
+    /* FileType instances share the method nodes of the type, so the
+     * callbacks are bound once and dispatch on the object context */
+    UA_Server_setMethodNode_callback(server, UA_NODEID_NUMERIC(0, UA_NS0ID_FILETYPE_OPEN), fileOpenMethod);
+    UA_Server_setMethodNode_callback(server, UA_NODEID_NUMERIC(0, UA_NS0ID_FILETYPE_WRITE), fileWriteMethod);
+    UA_Server_setMethodNode_callback(server, UA_NODEID_NUMERIC(0, UA_NS0ID_FILETYPE_READ), fileReadMethod);
+    UA_Server_setMethodNode_callback(server, UA_NODEID_NUMERIC(0, UA_NS0ID_FILETYPE_CLOSE), fileCloseMethod);
+    UA_Server_setMethodNode_callback(server, UA_NODEID_NUMERIC(0, UA_NS0ID_FILETYPE_GETPOSITION), fileGetPositionMethod);
+    UA_Server_setMethodNode_callback(server, UA_NODEID_NUMERIC(0, UA_NS0ID_FILETYPE_SETPOSITION), fileSetPositionMethod);
+    addTransferFileType(server);
+}
+
+void fileManagerAddWriteFiles(UA_Server *server, UA_NodeId objectId, const char *objectIdStr) {
+    char nodeIdStr[128];
+    snprintf(nodeIdStr, sizeof(nodeIdStr), "%s/WriteFiles", objectIdStr);
+    UA_Argument input[2] = {scalarArgument("Files", &UA_TYPES[UA_TYPES_NODEID]),
+                            scalarArgument("Contents", &UA_TYPES[UA_TYPES_BYTESTRING])};
+    input[0].valueRank = UA_VALUERANK_ONE_DIMENSION;
+    input[1].valueRank = UA_VALUERANK_ONE_DIMENSION;
+    UA_Argument results = scalarArgument("Results", &UA_TYPES[UA_TYPES_STATUSCODE]);
+    results.valueRank = UA_VALUERANK_ONE_DIMENSION;
+
+    UA_MethodAttributes ma = UA_MethodAttributes_default;
+    ma.displayName = UA_LOCALIZEDTEXT("", (char*)"WriteFiles");
+    ma.executable = true;
+    ma.userExecutable = true;
+    UA_Server_addMethodNode(server, UA_NODEID_STRING(1, nodeIdStr), objectId,
+                            UA_NODEID_NUMERIC(0, UA_NS0ID_HASCOMPONENT),
+                            UA_QUALIFIEDNAME(1, (char*)"WriteFiles"), ma, writeFilesMethod,
+                            2, input, 1, &results, NULL, NULL);
+}
+
+void fileStateClear(FileState *state) {
+    while(state->handlesSize > 0)
+        freeHandle(state, state->handles[state->handlesSize - 1]);
+    deltaJobDrop(state->delta);
+    state->delta = NULL;
+    free(state->handles);
+    state->handles = NULL;
+    fileMappingRelease(state->mapping);
+    state->mapping = NULL;
+    free(state->persistPath);
+    state->persistPath = NULL;
+
+    /* Sessions closing later must not find the state anymore */
+    for(size_t i = 0; i < registeredStatesSize; i++) {
+        if(registeredStates[i] != state)
+            continue;
+        registeredStates[i] = registeredStates[--registeredStatesSize];
+        break;
+    }
+    if(registeredStatesSize == 0) {
+        free(registeredStates);
+        registeredStates = NULL;
+        registeredStatesCapacity = 0;
+    }
+}
+
+FileState *fileStateNew(const char *path, UA_Boolean writeThrough) {
+    FileState *fs = (FileState*)calloc(1, sizeof(FileState));
+    if(!fs)
+        return NULL;
+    fs->persistPath = strdup(path);
+    if(!fs->persistPath) {
+        free(fs);
+        return NULL;
+    }
+    fs->writeThrough = writeThrough;
+    return fs;
+}
+
+void fileStateDelete(FileState *state) {
+    fileStateClear(state);
+    free(state);
+}
+
+UA_StatusCode addFileInstance(UA_Server *server, UA_NodeId parentId, const char* name, const char* nodeIdStr, FileState *state) {
     UA_ObjectAttributes f = UA_ObjectAttributes_default;
     f.displayName = UA_LOCALIZEDTEXT("", (char*)name);
     UA_NodeId nodeId = UA_NODEID_STRING(1, (char*)nodeIdStr);
 
-    UA_Server_addObjectNode(server, nodeId, parentId,
-                            UA_NODEID_NUMERIC(0, UA_NS0ID_HASCOMPONENT),
-                            UA_QUALIFIEDNAME(1, (char*)name),
-                            UA_NODEID_NUMERIC(0, UA_NS0ID_FILETYPE),
-                            f, state, NULL); // state is the context
-
-    bindMethod(server, nodeId, "Open",  fileOpenMethod);
-    bindMethod(server, nodeId, "Write", fileWriteMethod);
-    bindMethod(server, nodeId, "Read",  fileReadMethod);
-    bindMethod(server, nodeId, "Close", fileCloseMethod);
+    /* The mandatory properties are added between _begin and _finish with
+     * deterministic NodeIds, so _finish finds them by BrowseName and does
+     * not instantiate copies. The methods are not copied at all: instances
+     * reference the FileType and TransferFileType methods of fileManagerInit. */
+    UA_StatusCode res =
+        UA_Server_addNode_begin(server, UA_NODECLASS_OBJECT, nodeId, parentId,
+                                UA_NODEID_NUMERIC(0, UA_NS0ID_HASCOMPONENT),
+                                UA_QUALIFIEDNAME(1, (char*)name),
+                                UA_NODEID_STRING(1, (char*)"TransferFileType"),
+                                &f, &UA_TYPES[UA_TYPES_OBJECTATTRIBUTES],
+                                state, NULL); // state is the context
+    if(res != UA_STATUSCODE_GOOD) {
+        UA_LOG_WARNING(fileLogger, UA_LOGCATEGORY_USERLAND, "Adding %s failed: %s",
+                       nodeIdStr, UA_StatusCode_name(res));
+        return res;
+    }
+
+    UA_DataSource size = {readSize, NULL};
+    UA_DataSource openCount = {readOpenCount, NULL};
+    UA_DataSource writable = {readWritable, NULL};
+    addProperty(server, nodeId, nodeIdStr, 0, "Size", &UA_TYPES[UA_TYPES_UINT64], size, state);
+    addProperty(server, nodeId, nodeIdStr, 0, "OpenCount", &UA_TYPES[UA_TYPES_UINT16], openCount, state);
+    addProperty(server, nodeId, nodeIdStr, 0, "Writable", &UA_TYPES[UA_TYPES_BOOLEAN], writable, state);
+    addProperty(server, nodeId, nodeIdStr, 0, "UserWritable", &UA_TYPES[UA_TYPES_BOOLEAN], writable, state);
+    UA_Server_addNode_finish(server, nodeId);
+
+    /* Checksums of the last upload, not part of FileType */
+    UA_DataSource sha256 = {readSha256, NULL};
+    UA_DataSource crc32c = {readCrc32c, NULL};
+    addProperty(server, nodeId, nodeIdStr, 1, "Sha256", &UA_TYPES[UA_TYPES_BYTESTRING], sha256, state);
+    addProperty(server, nodeId, nodeIdStr, 1, "Crc32c", &UA_TYPES[UA_TYPES_UINT32], crc32c, state);
+
+    if(registeredStatesSize == registeredStatesCapacity) {
+        size_t capacity = registeredStatesCapacity ? registeredStatesCapacity * 2 : 16;
+        FileState **states = (FileState**)realloc(registeredStates,
+                                                  capacity * sizeof(FileState*));
+        if(!states) {
+            /* Unregistered, its handles would outlive their session */
+            UA_Server_deleteNode(server, nodeId, true);
+            UA_LOG_WARNING(fileLogger, UA_LOGCATEGORY_USERLAND, "Adding %s failed: %s",
+                           nodeIdStr, UA_StatusCode_name(UA_STATUSCODE_BADOUTOFMEMORY));
+            return UA_STATUSCODE_BADOUTOFMEMORY;
+        }
+        registeredStates = states;
+        registeredStatesCapacity = capacity;
+    }
+    registeredStates[registeredStatesSize++] = state;
+    return UA_STATUSCODE_GOOD;
 }
@@ -4,17 +4,156 @@
 extern "C" {
 #include "open62541.h"
 }
+#include "file_buffer.h"
+#include "file_stream.h"
+#include "file_mapping.h"
+#include "file_compress.h"
+#include "file_store.h"
+#include "file_digest.h"
 
+struct StoredVersion;
+struct DeltaJob;
+
+/* One Open() of a file. Handles belong to the session that opened them. */
 typedef struct {
-    UA_Byte *buffer;
-    size_t  bufferSize;
-    size_t  filePos;
-    UA_Boolean isOpen;
-    UA_Byte openMode;
-    char    persistPath[256];
+    UA_UInt32   id;
+    UA_NodeId   sessionId;
+    UA_Byte     openMode;
+    size_t      filePos;
+    UA_Boolean  dirty;     /* content replaces the file at Close */
+    UA_DateTime openedAt;  /* monotonic, for the transfer summary */
+    UA_UInt64   bytesRead;
+    UA_UInt64   bytesWritten;
+    FileMapping *mapping;  /* read-only handles */
+    FileBuffer  buffer;    /* buffered writers */
+    FileStream  stream;    /* write-through writers */
+    FileDecompressor *unpacked; /* read-only handles of compressed files */
+    FilePacker  *packer;   /* companion handles compressing on the fly */
+    FileStoreReader *chunks; /* read-only handles of files in a chunk store */
+    FileDigest  *digest;   /* writers: checksums of what was written front to back */
+    size_t      digested;  /* bytes covered by digest */
+    struct StoredVersion *base; /* patch uploads: the version copies refer to */
+    size_t      lastReadEnd;     /* readers: where the previous Read stopped */
+    size_t      readAheadEnd;    /* prefetched up to here */
+    size_t      readAheadWindow; /* grows while Reads follow each other */
+} FileHandle;
+
+typedef struct FileState {
+    char   *persistPath;     /* owned, freed by fileStateClear */
+    UA_Boolean writeThrough; /* stream writes to disk instead of buffering */
+    UA_Boolean compressed;   /* stored in the block format of file_compress.h */
+    FileStore *store;        /* content kept as chunks, persistPath is the manifest */
+
+    /* A companion serves the compressed form of another file read-only: the
+     * stored bytes if that file is compressed, else packed on the fly. Its
+     * Size is then the plain length until a complete transfer has packed the
+     * current version. */
+    const struct FileState *companionOf;
+
+    /* Open handles. Readers share one mapping, a writer is exclusive. */
+    FileHandle **handles;
+    size_t  handlesSize;
+    UA_UInt32 lastHandle;
+    FileMapping *mapping;    /* mapping handed to new readers */
+    size_t  pendingCommits;  /* closed, not yet in place on disk */
+    UA_DateTime lastUsed;    /* monotonic, last handle or property access */
+
+    /* Cached metadata served by the Size/Writable property data sources,
+     * filled on first read so registering a file costs no stat(). Refreshed
+     * after FILEMANAGER_STAT_TTL or when a new file version is mapped. */
+    UA_Boolean statValid;
+    UA_DateTime statTime;     /* monotonic */
+    UA_UInt64 size;
+    UA_Boolean writable;
+    UA_UInt64 packedSize;     /* companion: packed length of ... */
+    UA_UInt64 packedStamp[2]; /* ... the plain file with this size and mtime */
+
+    /* Checksums of the content last written through this server, valid if
+     * that upload wrote the file front to back. Served by the Sha256 and
+     * Crc32c properties once its commit is in place; until then they stay
+     * in the next* fields (one commit per file is in flight at a time). */
+    UA_Boolean digestValid;
+    UA_Byte sha256[FILEDIGEST_SHA256_SIZE];
+    UA_UInt32 crc32c;
+    UA_Boolean nextDigestValid;
+    UA_Byte nextSha256[FILEDIGEST_SHA256_SIZE];
+    UA_UInt32 nextCrc32c;
+
+    struct DeltaJob *delta;  /* last GetSignatures/GetMissingRanges request */
+
+    FileBufferStats stats;
 } FileState;
 
-void addFileInstance(UA_Server *server, UA_NodeId parentId, const char* name,
-                     const char* nodeIdStr, FileState *state);
+/* Binds the FileType method callbacks and hooks session teardown so handles
+ * of closed sessions are released. Call after the server configuration
+ * (access control) is in place and before adding file instances.
+ *
+ * File instances are of TransferFileType (ns=1;s=TransferFileType), a
+ * FileType subtype with methods shared by all instances:
+ *
+ *   GetSignatures(BlockSize UInt32) -> Signatures ByteString
+ *     block signatures of the stored content (see file_delta.h), BlockSize
+ *     0 picks one from the file size. Files larger than
+ *     FILEMANAGER_DELTA_INLINE are processed on the I/O workers: the call
+ *     answers BadWaitingForInitialData until the result is ready, the same
+ *     call repeated then returns it.
+ *   WritePatch(FileHandle UInt32, Patch ByteString)
+ *     a Write whose data is rebuilt from a patch against the version stored
+ *     when the patch was first applied on the handle
+ *   GetMissingRanges(Signatures ByteString) -> Recipe ByteString
+ *     given the signatures of the client's old copy, copies from that copy
+ *     and the ranges of the stored content to Read, in order. Large files are
+ *     processed off-thread like GetSignatures.
+ *   ReadRanges(FileHandle UInt32, Offsets UInt64[], Lengths UInt32[]) -> Data ByteString[]
+ *     up to FILEMANAGER_MAX_RANGES reads in one Call, without moving the
+ *     position; read-only handles answer with views into the mapping
+ *
+ * While a Close of the file is still being committed, Open, GetSignatures
+ * and GetMissingRanges answer BadResourceUnavailable and the client retries. */
+#define FILEMANAGER_MAX_RANGES 1024
+#define FILEMANAGER_DELTA_INLINE ((size_t)1024 * 1024)
+
+/* Age after which Size/Writable are read from the file system again, so
+ * changes by other processes show without an inotify event */
+#define FILEMANAGER_STAT_TTL UA_DATETIME_SEC
+
+/* Reads that continue where the previous one stopped prefetch the content
+ * after them, in a window doubling from MIN up to MAX (at least two Reads) */
+#define FILEMANAGER_READAHEAD_MIN ((size_t)256 * 1024)
+#define FILEMANAGER_READAHEAD_MAX ((size_t)8 * 1024 * 1024)
+
+/* A Read of a companion packed on the fly returns at most this much: its
+ * length is not known up front to bound the request by */
+#define FILEMANAGER_PACKED_READ_MAX (16 * FILECOMPRESS_BLOCK_SIZE)
+void fileManagerInit(UA_Server *server);
+
+/* Adds the node of state, which stays owned by the caller. On failure no
+ * node is left behind. */
+UA_StatusCode addFileInstance(UA_Server *server, UA_NodeId parentId, const char* name,
+                              const char* nodeIdStr, FileState *state);
+
+/* Adds WriteFiles to an object, for distributing a set of files in one Call:
+ *
+ *   WriteFiles(Files NodeId[], Contents ByteString[]) -> Results StatusCode[]
+ *     replaces the content of each file instance. Nothing is written unless
+ *     every file can be (registered, not open, listed once, no commit of it
+ *     in flight: BadResourceUnavailable, retry); the others then report
+ *     BadOperationAbandoned. The set is committed as one group, see
+ *     fileCommitGroupBegin. Like Close, the Call returns once it is queued:
+ *     Good means accepted. If the group fails later that is logged and the
+ *     Sha256/Crc32c properties of its files are cleared. At most
+ *     FILEMANAGER_MAX_FILES files per Call. */
+#define FILEMANAGER_MAX_FILES 256
+void fileManagerAddWriteFiles(UA_Server *server, UA_NodeId objectId, const char *objectIdStr);
+
+/* Closes all handles (discarding uncommitted writes) and frees what the
+ * state owns; the FileState itself belongs to the caller */
+void fileStateClear(FileState *state);
+
+/* Heap-allocated state for path, NULL when out of memory */
+FileState *fileStateNew(const char *path, UA_Boolean writeThrough);
+
+/* fileStateClear plus freeing a state from fileStateNew */
+void fileStateDelete(FileState *state);
 
 #endif
@@ -0,0 +1,109 @@
+#include "file_mapping.h"
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+FileMapping *fileMappingOpen(const char *path) {
+    FileMapping *m = (FileMapping*)calloc(1, sizeof(FileMapping));
+    if(!m)
+        return NULL;
+    m->refCount = 1;
+    m->fd = -1;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        if(errno == ENOENT)
+            return m;
+        free(m);
+        return NULL;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        free(m);
+        return NULL;
+    }
+    m->ino = st.st_ino;
+    m->mtime = st.st_mtime;
+
+    if(st.st_size > 0) {
+        void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(p == MAP_FAILED) {
+            close(fd);
+            free(m);
+            return NULL;
+        }
+        /* Clients read front to back: let the kernel read ahead aggressively */
+        madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+        m->data = (const UA_Byte*)p;
+        m->length = (size_t)st.st_size;
+    }
+
+    /* Kept to notice truncation and read past it */
+    if(m->data)
+        m->fd = fd;
+    else
+        close(fd);
+    return m;
+}
+
+UA_Boolean fileMappingIsCurrent(const FileMapping *m, const char *path) {
+    struct stat st;
+    if(stat(path, &st) != 0)
+        return m->ino == 0 && m->length == 0;
+    return st.st_ino == m->ino && st.st_mtime == m->mtime &&
+           (size_t)st.st_size == m->length;
+}
+
+void fileMappingPrefetch(const FileMapping *m, size_t offset, size_t length) {
+    if(!m->data || offset >= m->length)
+        return;
+    if(length > m->length - offset)
+        length = m->length - offset;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = offset - offset % page;
+    madvise((void*)(m->data + start), length + (offset - start), MADV_WILLNEED);
+}
+
+UA_Boolean fileMappingIntact(const FileMapping *m) {
+    if(!m->data)
+        return true;
+    struct stat st;
+    return fstat(m->fd, &st) == 0 && (size_t)st.st_size >= m->length;
+}
+
+size_t fileMappingRead(const FileMapping *m, size_t offset, UA_Byte *dst, size_t length) {
+    if(!m->data || offset >= m->length)
+        return 0;
+    if(length > m->length - offset)
+        length = m->length - offset;
+    size_t done = 0;
+    while(done < length) {
+        ssize_t n = pread(m->fd, dst + done, length - done, (off_t)(offset + done));
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        done += (size_t)n;
+    }
+    return done;
+}
+
+void fileMappingRetain(FileMapping *m) {
+    m->refCount++;
+}
+
+void fileMappingRelease(FileMapping *m) {
+    if(!m || --m->refCount > 0)
+        return;
+    if(m->data)
+        munmap((void*)m->data, m->length);
+    if(m->fd >= 0)
+        close(m->fd);
+    free(m);
+}
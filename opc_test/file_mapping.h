@@ -0,0 +1,47 @@
+#ifndef FILE_MAPPING_H
+#define FILE_MAPPING_H
+
+extern "C" {
+#include "open62541.h"
+}
+#include <sys/types.h>
+
+/* Read-only view of a file on disk, shared by every reader of the same file
+ * version and freed with the last reference. Opening only maps the file,
+ * pages are faulted in as Read requests touch them.
+ *
+ * The mapping is shared with the file: if another process truncates the
+ * file in place (logrotate copytruncate), touching the pages past the new
+ * end raises SIGBUS. Check fileMappingIntact right before handing out data
+ * and read with fileMappingRead otherwise. Files replaced by rename, as
+ * this server commits, are not affected. */
+typedef struct {
+    const UA_Byte *data;   /* NULL for an empty or missing file */
+    size_t         length;
+    int            fd;     /* of the mapped file, -1 without data */
+    ino_t          ino;    /* identity of the mapped file version */
+    time_t         mtime;
+    size_t         refCount;
+} FileMapping;
+
+/* A missing file maps as empty. Returns NULL on error. */
+FileMapping *fileMappingOpen(const char *path);
+
+/* True if path still names the file version behind the mapping */
+UA_Boolean fileMappingIsCurrent(const FileMapping *m, const char *path);
+
+/* Starts reading the pages of a range in the background, so touching them
+ * later does not wait for the disk */
+void fileMappingPrefetch(const FileMapping *m, size_t offset, size_t length);
+
+/* False if the file was truncated below the mapped length since */
+UA_Boolean fileMappingIntact(const FileMapping *m);
+
+/* Copies up to length bytes at offset with pread, safe after truncation.
+ * Returns the count, short at the current end of the file. */
+size_t fileMappingRead(const FileMapping *m, size_t offset, UA_Byte *dst, size_t length);
+
+void fileMappingRetain(FileMapping *m);
+void fileMappingRelease(FileMapping *m);
+
+#endif
@@ -0,0 +1,574 @@
+#include "file_store.h"
+#include "file_cache.h"
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <climits>
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <mbedtls/md.h>
+
+#define KEY_SIZE 32
+#define HEADER_SIZE 24
+#define ENTRY_SIZE (KEY_SIZE + 4)
+#define MANIFEST_VERSION 1
+#define MAX_CHUNK_LENGTH ((UA_UInt32)16 * 1024 * 1024)
+
+static const UA_Byte magic[4] = {'O', 'P', 'C', 'D'};
+
+/* Raw SHA-256 of a chunk */
+typedef std::string ChunkKey;
+
+typedef struct {
+    ChunkKey key;
+    UA_UInt32 length;
+} ManifestEntry;
+
+struct FileStore {
+    const UA_Logger *logger;
+    std::string root;
+    std::map<ChunkKey, size_t> refs;
+    std::map<std::string, std::vector<ChunkKey> > files; /* attached path -> chunks held */
+    std::set<ChunkKey> unheld;  /* dropped to no reference, removed by sweep */
+    size_t writes;              /* in flight, see fileStoreWriteBegin */
+};
+
+/* Gear table of the rolling hash, the same for every run so that equal
+ * content is always cut at the same places */
+static UA_UInt64 gear[256];
+static UA_UInt64 cutMask;
+
+static void initGear(void) {
+    UA_UInt64 x = 0x4f5043554147ULL;
+    for(size_t i = 0; i < 256; i++) {
+        /* splitmix64 */
+        UA_UInt64 z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    /* The high bits of the hash depend on the last 64 bytes */
+    size_t bits = 0;
+    while(((size_t)1 << bits) < FILESTORE_AVG_CHUNK)
+        bits++;
+    cutMask = ~(UA_UInt64)0 << (64 - bits);
+}
+
+static void putU32(UA_Byte *p, UA_UInt32 v) {
+    for(size_t i = 0; i < 4; i++)
+        p[i] = (UA_Byte)(v >> (8 * i));
+}
+
+static void putU64(UA_Byte *p, UA_UInt64 v) {
+    for(size_t i = 0; i < 8; i++)
+        p[i] = (UA_Byte)(v >> (8 * i));
+}
+
+static UA_UInt32 getU32(const UA_Byte *p) {
+    UA_UInt32 v = 0;
+    for(size_t i = 4; i > 0; i--)
+        v = (v << 8) | p[i - 1];
+    return v;
+}
+
+static UA_UInt64 getU64(const UA_Byte *p) {
+    UA_UInt64 v = 0;
+    for(size_t i = 8; i > 0; i--)
+        v = (v << 8) | p[i - 1];
+    return v;
+}
+
+static UA_StatusCode writeAll(int fd, const UA_Byte *data, size_t length) {
+    while(length > 0) {
+        ssize_t n = write(fd, data, length);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return UA_STATUSCODE_BADINTERNALERROR;
+        data += n;
+        length -= (size_t)n;
+    }
+    return UA_STATUSCODE_GOOD;
+}
+
+static UA_Boolean readAll(int fd, UA_Byte *dst, size_t length, UA_UInt64 offset) {
+    size_t done = 0;
+    while(done < length) {
+        ssize_t n = pread(fd, dst + done, length - done, (off_t)(offset + done));
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        done += (size_t)n;
+    }
+    return true;
+}
+
+static std::string chunkDir(const FileStore *store, const ChunkKey &key) {
+    char hex[3];
+    snprintf(hex, sizeof(hex), "%02x", (UA_Byte)key[0]);
+    return store->root + "/" + hex;
+}
+
+static std::string chunkPath(const FileStore *store, const ChunkKey &key) {
+    char hex[2 * KEY_SIZE + 1];
+    for(size_t i = 0; i < KEY_SIZE; i++)
+        snprintf(hex + 2 * i, 3, "%02x", (UA_Byte)key[i]);
+    return chunkDir(store, key) + "/" + hex;
+}
+
+/* Parses the manifest behind fd. isManifest stays false for other files. */
+static UA_StatusCode readManifest(int fd, UA_UInt64 fileSize, UA_Boolean *isManifest,
+                                  UA_UInt64 *plainLength, std::vector<ManifestEntry> *entries) {
+    *isManifest = false;
+    UA_Byte header[HEADER_SIZE];
+    if(fileSize < HEADER_SIZE)
+        return UA_STATUSCODE_GOOD;
+    if(!readAll(fd, header, HEADER_SIZE, 0))
+        return UA_STATUSCODE_BADINTERNALERROR;
+    if(memcmp(header, magic, 4) != 0)
+        return UA_STATUSCODE_GOOD;
+
+    UA_UInt64 count = getU64(header + 16);
+    if(getU32(header + 4) != MANIFEST_VERSION || count > fileSize / ENTRY_SIZE ||
+       HEADER_SIZE + count * ENTRY_SIZE != fileSize)
+        return UA_STATUSCODE_BADDECODINGERROR;
+
+    std::vector<UA_Byte> raw((size_t)(count * ENTRY_SIZE));
+    if(count > 0 && !readAll(fd, &raw[0], raw.size(), HEADER_SIZE))
+        return UA_STATUSCODE_BADINTERNALERROR;
+    UA_UInt64 total = 0;
+    if(entries)
+        entries->resize((size_t)count);
+    for(size_t i = 0; i < count; i++) {
+        const UA_Byte *p = &raw[i * ENTRY_SIZE];
+        UA_UInt32 length = getU32(p + KEY_SIZE);
+        if(length == 0 || length > MAX_CHUNK_LENGTH)
+            return UA_STATUSCODE_BADDECODINGERROR;
+        total += length;
+        if(entries) {
+            (*entries)[i].key.assign((const char*)p, KEY_SIZE);
+            (*entries)[i].length = length;
+        }
+    }
+    if(total != getU64(header + 8))
+        return UA_STATUSCODE_BADDECODINGERROR;
+    *isManifest = true;
+    *plainLength = total;
+    return UA_STATUSCODE_GOOD;
+}
+
+/* Chunks of the manifest at path, none for other files */
+static UA_StatusCode manifestKeys(const char *path, std::vector<ChunkKey> *keys) {
+    keys->clear();
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return (errno == ENOENT) ? UA_STATUSCODE_GOOD : UA_STATUSCODE_BADINTERNALERROR;
+    struct stat st;
+    UA_Boolean isManifest = false;
+    UA_UInt64 plainLength;
+    std::vector<ManifestEntry> entries;
+    UA_StatusCode res = (fstat(fd, &st) == 0)
+        ? readManifest(fd, (UA_UInt64)st.st_size, &isManifest, &plainLength, &entries)
+        : UA_STATUSCODE_BADINTERNALERROR;
+    close(fd);
+    for(size_t i = 0; i < entries.size() && isManifest; i++)
+        keys->push_back(entries[i].key);
+    return res;
+}
+
+static void hold(FileStore *store, const std::vector<ChunkKey> &keys) {
+    for(size_t i = 0; i < keys.size(); i++) {
+        if(store->refs[keys[i]]++ == 0)
+            store->unheld.erase(keys[i]);
+    }
+}
+
+static void release(FileStore *store, const std::vector<ChunkKey> &keys) {
+    for(size_t i = 0; i < keys.size(); i++) {
+        std::map<ChunkKey, size_t>::iterator it = store->refs.find(keys[i]);
+        if(it == store->refs.end() || --it->second > 0)
+            continue;
+        store->refs.erase(it);
+        store->unheld.insert(keys[i]);
+    }
+}
+
+/* Removes the chunks nobody holds. Not while a write is in flight: it may
+ * have found one of them present and referenced it in its manifest. */
+static void sweep(FileStore *store) {
+    if(store->writes > 0)
+        return;
+    for(std::set<ChunkKey>::iterator it = store->unheld.begin(); it != store->unheld.end(); ++it) {
+        std::string path = chunkPath(store, *it);
+        if(unlink(path.c_str()) != 0 && errno != ENOENT)
+            UA_LOG_WARNING(store->logger, UA_LOGCATEGORY_USERLAND,
+                           "Removing chunk %s failed: %s", path.c_str(), strerror(errno));
+    }
+    store->unheld.clear();
+}
+
+FileStore *fileStoreOpen(const UA_Logger *logger, const char *root) {
+    if(mkdir(root, 0755) != 0 && errno != EEXIST) {
+        UA_LOG_ERROR(logger, UA_LOGCATEGORY_USERLAND, "Cannot create chunk store %s: %s",
+                     root, strerror(errno));
+        return NULL;
+    }
+    initGear();
+    FileStore *store = new FileStore();
+    store->logger = logger;
+    store->root = root;
+    store->writes = 0;
+    return store;
+}
+
+void fileStoreDelete(FileStore *store) {
+    delete store;
+}
+
+void fileStoreAttach(FileStore *store, const char *path) {
+    std::vector<ChunkKey> keys;
+    if(manifestKeys(path, &keys) != UA_STATUSCODE_GOOD)
+        UA_LOG_WARNING(store->logger, UA_LOGCATEGORY_USERLAND,
+                       "Cannot read the manifest %s", path);
+    hold(store, keys);
+    std::vector<ChunkKey> &held = store->files[path];
+    release(store, held);
+    held.swap(keys);
+}
+
+/* Content-defined cut: the first position from the minimum chunk length on
+ * where the rolling hash matches the mask, else all of data */
+static size_t findCut(const UA_Byte *data, size_t length) {
+    if(length <= FILESTORE_MIN_CHUNK)
+        return length;
+    UA_UInt64 h = 0;
+    for(size_t i = FILESTORE_MIN_CHUNK - 64; i < length; i++) {
+        h = (h << 1) + gear[data[i]];
+        if(i >= FILESTORE_MIN_CHUNK && (h & cutMask) == 0)
+            return i + 1;
+    }
+    return length;
+}
+
+/* Final chunk path -> temporary file holding it, not yet durable */
+typedef std::map<std::string, std::string> StagedChunks;
+
+/* Writes the chunk to a temporary file next to its final name, unless it
+ * is present or staged already */
+static UA_StatusCode stageChunk(const FileStore *store, const ChunkKey &key,
+                                const UA_Byte *data, size_t length, StagedChunks *staged) {
+    std::string path = chunkPath(store, key);
+    if(staged->count(path) > 0 || access(path.c_str(), F_OK) == 0)
+        return UA_STATUSCODE_GOOD;
+    std::string dir = chunkDir(store, key);
+    if(mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+        return UA_STATUSCODE_BADINTERNALERROR;
+
+    char tmpPath[PATH_MAX];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.part.XXXXXX", path.c_str());
+    int fd = mkstemp(tmpPath);
+    if(fd < 0)
+        return UA_STATUSCODE_BADINTERNALERROR;
+    fchmod(fd, 0444);
+    UA_StatusCode res = writeAll(fd, data, length);
+    if(close(fd) != 0)
+        res = UA_STATUSCODE_BADINTERNALERROR;
+    if(res != UA_STATUSCODE_GOOD) {
+        unlink(tmpPath);
+        return res;
+    }
+    (*staged)[path] = tmpPath;
+    return UA_STATUSCODE_GOOD;
+}
+
+static UA_StatusCode syncDirectory(const std::string &dir) {
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if(fd < 0)
+        return UA_STATUSCODE_BADINTERNALERROR;
+    int r = fsync(fd);
+    close(fd);
+    return (r == 0) ? UA_STATUSCODE_GOOD : UA_STATUSCODE_BADINTERNALERROR;
+}
+
+/* One syncfs for all staged chunks, then their final names and one fsync
+ * per directory. A chunk is durable before it is named, so a present chunk
+ * is always complete. With res bad the staged files are only removed. */
+static UA_StatusCode nameStaged(const FileStore *store, const StagedChunks &staged,
+                                UA_StatusCode res) {
+    if(res == UA_STATUSCODE_GOOD && !staged.empty()) {
+        int fd = open(store->root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(fd < 0 || syncfs(fd) != 0)
+            res = UA_STATUSCODE_BADINTERNALERROR;
+        if(fd >= 0)
+            close(fd);
+    }
+    std::set<std::string> dirs;
+    for(StagedChunks::const_iterator it = staged.begin(); it != staged.end(); ++it) {
+        /* Another writer may have saved the same chunk meanwhile */
+        if(res == UA_STATUSCODE_GOOD && link(it->second.c_str(), it->first.c_str()) != 0 &&
+           errno != EEXIST)
+            res = UA_STATUSCODE_BADINTERNALERROR;
+        if(res == UA_STATUSCODE_GOOD)
+            dirs.insert(it->first.substr(0, it->first.rfind('/')));
+        unlink(it->second.c_str());
+    }
+    for(std::set<std::string>::iterator it = dirs.begin();
+        it != dirs.end() && res == UA_STATUSCODE_GOOD; ++it)
+        res = syncDirectory(*it);
+    return res;
+}
+
+UA_StatusCode fileStoreWrite(const FileStore *store, int fd, FileCompressSource source,
+                             void *context, size_t length) {
+    const mbedtls_md_info_t *sha256 = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+    UA_Byte *window = (UA_Byte*)malloc(FILESTORE_MAX_CHUNK);
+    if(!sha256 || !window) {
+        free(window);
+        return UA_STATUSCODE_BADINTERNALERROR;
+    }
+
+    /* The manifest is small next to the content: one entry per chunk */
+    std::vector<UA_Byte> manifest(HEADER_SIZE);
+    StagedChunks staged;
+    UA_StatusCode res = UA_STATUSCODE_GOOD;
+    size_t consumed = 0, filled = 0;
+    for(;;) {
+        size_t n = std::min(FILESTORE_MAX_CHUNK - filled, length - consumed);
+        if(n > 0 && source(context, consumed, window + filled, n) != n) {
+            res = UA_STATUSCODE_BADINTERNALERROR;
+            break;
+        }
+        consumed += n;
+        filled += n;
+        if(filled == 0)
+            break;
+
+        size_t cut = findCut(window, filled);
+        UA_Byte digest[KEY_SIZE];
+        if(mbedtls_md(sha256, window, cut, digest) != 0) {
+            res = UA_STATUSCODE_BADINTERNALERROR;
+            break;
+        }
+        ChunkKey key((const char*)digest, KEY_SIZE);
+        res = stageChunk(store, key, window, cut, &staged);
+        if(res != UA_STATUSCODE_GOOD)
+            break;
+
+        size_t at = manifest.size();
+        manifest.resize(at + ENTRY_SIZE);
+        memcpy(&manifest[at], digest, KEY_SIZE);
+        putU32(&manifest[at + KEY_SIZE], (UA_UInt32)cut);
+        memmove(window, window + cut, filled - cut);
+        filled -= cut;
+    }
+    free(window);
+
+    /* New chunks are named durably before the manifest refers to them */
+    res = nameStaged(store, staged, res);
+    if(res != UA_STATUSCODE_GOOD)
+        return res;
+
+    memcpy(&manifest[0], magic, 4);
+    putU32(&manifest[4], MANIFEST_VERSION);
+    putU64(&manifest[8], (UA_UInt64)length);
+    putU64(&manifest[16], (UA_UInt64)((manifest.size() - HEADER_SIZE) / ENTRY_SIZE));
+    return writeAll(fd, &manifest[0], manifest.size());
+}
+
+void fileStoreWriteBegin(FileStore *store) {
+    store->writes++;
+}
+
+void fileStoreWriteEnd(FileStore *store, const char *path, UA_Boolean committed) {
+    store->writes--;
+    if(committed)
+        fileStoreAttach(store, path);
+    sweep(store);
+}
+
+UA_StatusCode fileStoreLength(const char *path, UA_UInt64 *length) {
+    *length = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return (errno == ENOENT) ? UA_STATUSCODE_GOOD : UA_STATUSCODE_BADINTERNALERROR;
+    struct stat st;
+    UA_Boolean isManifest = false;
+    UA_StatusCode res = UA_STATUSCODE_BADINTERNALERROR;
+    if(fstat(fd, &st) == 0) {
+        res = readManifest(fd, (UA_UInt64)st.st_size, &isManifest, length, NULL);
+        if(!isManifest)
+            *length = (UA_UInt64)st.st_size;
+    }
+    close(fd);
+    return res;
+}
+
+struct FileStoreReader {
+    FileStore *store;
+    int fd;                         /* file that is not a manifest, else -1 */
+    UA_UInt64 length;
+    std::vector<ChunkKey> keys;     /* held until the reader is closed */
+    std::vector<UA_UInt64> offsets; /* plain start of every chunk, plus the end */
+    size_t cachedChunk;             /* chunk open in chunkFd, keys.size() if none */
+    int chunkFd;
+    FileCachePage *page;            /* pinned chunk page read last, NULL if none */
+};
+
+FileStoreReader *fileStoreReaderOpen(FileStore *store, const char *path) {
+    FileStoreReader *r = new FileStoreReader();
+    r->store = store;
+    r->length = 0;
+    r->chunkFd = -1;
+    r->page = NULL;
+    r->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(r->fd < 0) {
+        r->cachedChunk = 0;
+        if(errno == ENOENT)
+            return r; /* empty */
+        delete r;
+        return NULL;
+    }
+
+    struct stat st;
+    UA_Boolean isManifest = false;
+    std::vector<ManifestEntry> entries;
+    if(fstat(r->fd, &st) != 0 ||
+       readManifest(r->fd, (UA_UInt64)st.st_size, &isManifest, &r->length, &entries) != UA_STATUSCODE_GOOD) {
+        close(r->fd);
+        delete r;
+        return NULL;
+    }
+    if(!isManifest) {
+        r->length = (UA_UInt64)st.st_size;
+        r->cachedChunk = 0;
+        return r;
+    }
+
+    close(r->fd);
+    r->fd = -1;
+    UA_UInt64 offset = 0;
+    for(size_t i = 0; i < entries.size(); i++) {
+        r->keys.push_back(entries[i].key);
+        r->offsets.push_back(offset);
+        offset += entries[i].length;
+    }
+    r->offsets.push_back(offset);
+    r->cachedChunk = r->keys.size();
+    hold(store, r->keys);
+    return r;
+}
+
+size_t fileStoreReaderLength(const FileStoreReader *r) {
+    return (size_t)r->length;
+}
+
+static UA_Boolean openChunk(FileStoreReader *r, size_t k) {
+    if(k == r->cachedChunk)
+        return true;
+    if(r->chunkFd >= 0)
+        close(r->chunkFd);
+    r->cachedChunk = r->keys.size();
+    r->chunkFd = open(chunkPath(r->store, r->keys[k]).c_str(), O_RDONLY | O_CLOEXEC);
+    if(r->chunkFd < 0)
+        return false;
+    r->cachedChunk = k;
+    return true;
+}
+
+/* Pins page p of chunk k. Chunks never change, so their pages are cached
+ * under the chunk hash and shared by every file containing the chunk. */
+static UA_Boolean loadPage(FileStoreReader *r, size_t k, size_t p) {
+    FileCacheKey key;
+    memcpy(key.id, r->keys[k].data(), sizeof(key.id));
+    key.page = p;
+    if(r->page && r->page->key.page == p && memcmp(r->page->key.id, key.id, sizeof(key.id)) == 0)
+        return true;
+    fileCacheRelease(r->page);
+    r->page = fileCacheGet(&key);
+    if(r->page)
+        return true;
+
+    size_t chunkLength = (size_t)(r->offsets[k + 1] - r->offsets[k]);
+    size_t start = p * FILECACHE_PAGE_SIZE;
+    size_t n = std::min(FILECACHE_PAGE_SIZE, chunkLength - start);
+    UA_Byte *data = (UA_Byte*)malloc(n);
+    if(!data || !openChunk(r, k) || !readAll(r->chunkFd, data, n, start)) {
+        free(data);
+        return false;
+    }
+    r->page = fileCacheInsert(&key, data, n);
+    return r->page != NULL;
+}
+
+size_t fileStoreReaderRead(FileStoreReader *r, size_t offset, UA_Byte *dst, size_t length) {
+    if(offset >= r->length)
+        return 0;
+    if(length > r->length - offset)
+        length = (size_t)(r->length - offset);
+    if(r->fd >= 0)
+        return readAll(r->fd, dst, length, offset) ? length : 0;
+
+    size_t done = 0;
+    while(done < length) {
+        UA_UInt64 at = offset + done;
+        size_t k = (size_t)(std::upper_bound(r->offsets.begin(), r->offsets.end(), at) -
+                            r->offsets.begin()) - 1;
+        size_t inChunk = (size_t)(at - r->offsets[k]);
+        if(!loadPage(r, k, inChunk / FILECACHE_PAGE_SIZE))
+            break;
+        size_t inPage = inChunk % FILECACHE_PAGE_SIZE;
+        if(inPage >= r->page->length)
+            break;
+        size_t n = std::min(r->page->length - inPage, length - done);
+        memcpy(dst + done, r->page->data + inPage, n);
+        done += n;
+    }
+    return done;
+}
+
+void fileStoreReaderPrefetch(const FileStoreReader *r, size_t offset, size_t length) {
+    if(offset >= r->length || length == 0)
+        return;
+    if(length > r->length - offset)
+        length = (size_t)(r->length - offset);
+    if(r->fd >= 0) {
+        posix_fadvise(r->fd, (off_t)offset, (off_t)length, POSIX_FADV_WILLNEED);
+        return;
+    }
+
+    /* The page cache keeps what is read ahead after the chunk is closed */
+    size_t k = (size_t)(std::upper_bound(r->offsets.begin(), r->offsets.end(), offset) -
+                        r->offsets.begin()) - 1;
+    for(; k < r->keys.size() && r->offsets[k] < offset + length; k++) {
+        if(k == r->cachedChunk) {
+            posix_fadvise(r->chunkFd, 0, 0, POSIX_FADV_WILLNEED);
+            continue;
+        }
+        int fd = open(chunkPath(r->store, r->keys[k]).c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+            continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+}
+
+void fileStoreReaderClose(FileStoreReader *r) {
+    if(!r)
+        return;
+    if(r->fd >= 0)
+        close(r->fd);
+    if(r->chunkFd >= 0)
+        close(r->chunkFd);
+    fileCacheRelease(r->page);
+    release(r->store, r->keys);
+    sweep(r->store);
+    delete r;
+}
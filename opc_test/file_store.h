@@ -0,0 +1,70 @@
+#ifndef FILE_STORE_H
+#define FILE_STORE_H
+
+extern "C" {
+#include "open62541.h"
+}
+#include "file_compress.h"
+
+/* Content-addressed chunk store. Files kept in a store are cut into chunks
+ * at content-defined boundaries (a gear rolling hash), so an insertion only
+ * changes the chunks around it. Each chunk is saved once under its SHA-256
+ * as "<root>/<first two hex digits>/<64 hex digits>", and the file itself
+ * becomes a small manifest listing its chunks:
+ *
+ *   "OPCD" version:u32 | plainLength:u64 | chunkCount:u64 |
+ *   (sha256:32 bytes | length:u32) [chunkCount]
+ *
+ * Integers are little endian. Identical files and repeated chunks take the
+ * space of one copy, and readers of all of them share the same chunk files.
+ *
+ * Chunks are reference counted on the server thread: every attached file
+ * holds its chunks, every open reader the chunks of the version it opened.
+ * Chunks nobody holds are removed once no write into the store is in
+ * flight, so a write never links to a chunk that disappears under it.
+ * Chunks left behind by a crash between writing chunks and the manifest
+ * are not reclaimed. */
+#define FILESTORE_MIN_CHUNK ((size_t)16 * 1024)
+#define FILESTORE_AVG_CHUNK ((size_t)64 * 1024) /* power of two */
+#define FILESTORE_MAX_CHUNK ((size_t)256 * 1024)
+
+typedef struct FileStore FileStore;
+
+/* Uses (and creates) the directory root. NULL if it cannot be created. */
+FileStore *fileStoreOpen(const UA_Logger *logger, const char *root);
+
+/* Every reader must be closed before */
+void fileStoreDelete(FileStore *store);
+
+/* Counts the chunks of the manifest at path as held. Reads the manifest,
+ * a missing file or one that is not a manifest holds nothing. */
+void fileStoreAttach(FileStore *store, const char *path);
+
+/* Worker thread: saves the chunks of length bytes taken from source and
+ * writes the manifest to fd. The new chunks are written first and flushed
+ * together with one syncfs before they are named. Only touches the disk,
+ * the reference counts are updated by fileStoreWriteEnd. */
+UA_StatusCode fileStoreWrite(const FileStore *store, int fd, FileCompressSource source,
+                             void *context, size_t length);
+
+/* Brackets a write on the server thread. With committed set the manifest at
+ * path is in place and replaces what the file held before. */
+void fileStoreWriteBegin(FileStore *store);
+void fileStoreWriteEnd(FileStore *store, const char *path, UA_Boolean committed);
+
+/* Plain length of the file at path. Files that are not manifests (yet)
+ * count with their size on disk, a missing file is empty. */
+UA_StatusCode fileStoreLength(const char *path, UA_UInt64 *length);
+
+/* Random access to the plain content of the file version at path. Files
+ * that are not manifests are read as they are. */
+typedef struct FileStoreReader FileStoreReader;
+
+FileStoreReader *fileStoreReaderOpen(FileStore *store, const char *path);
+size_t fileStoreReaderLength(const FileStoreReader *r);
+size_t fileStoreReaderRead(FileStoreReader *r, size_t offset, UA_Byte *dst, size_t length);
+/* Starts reading the chunks of a plain range in the background */
+void fileStoreReaderPrefetch(const FileStoreReader *r, size_t offset, size_t length);
+void fileStoreReaderClose(FileStoreReader *r);
+
+#endif
@@ -0,0 +1,229 @@
+#include "file_stream.h"
+#include "file_commit.h"
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static UA_StatusCode writeAll(int fd, const UA_Byte *data, size_t length, size_t offset) {
+    while(length > 0) {
+        ssize_t n = pwrite(fd, data, length, (off_t)offset);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return UA_STATUSCODE_BADINTERNALERROR;
+        }
+        data += n;
+        offset += (size_t)n;
+        length -= (size_t)n;
+    }
+    return UA_STATUSCODE_GOOD;
+}
+
+/* O_APPEND: plain write(), the kernel puts the bytes at the current end */
+static UA_StatusCode appendAll(int fd, const UA_Byte *data, size_t length) {
+    while(length > 0) {
+        ssize_t n = write(fd, data, length);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return UA_STATUSCODE_BADINTERNALERROR;
+        }
+        data += n;
+        length -= (size_t)n;
+    }
+    return UA_STATUSCODE_GOOD;
+}
+
+/* Append mode: other processes may append too, the end is taken from the
+ * file each time */
+static void refreshAppend(FileStream *fs) {
+    struct stat st;
+    if(fstat(fs->fd, &st) != 0)
+        return;
+    fs->length = (size_t)st.st_size;
+}
+
+static UA_StatusCode flushStaging(FileStream *fs) {
+    if(fs->stagingUsed == 0)
+        return UA_STATUSCODE_GOOD;
+    UA_StatusCode res = writeAll(fs->fd, fs->staging, fs->stagingUsed, fs->stagingOffset);
+    fs->stagingOffset += fs->stagingUsed;
+    fs->stagingUsed = 0;
+    return res;
+}
+
+/* Not staged: tail-following readers of the file see every Write at once */
+static UA_StatusCode appendWrite(FileStream *fs, const UA_Byte *data, size_t length) {
+    UA_StatusCode res = appendAll(fs->fd, data, length);
+    refreshAppend(fs);
+    return res;
+}
+
+/* Copies the existing file through the staging buffer, constant memory */
+static UA_StatusCode copyExisting(FileStream *fs, const char *persistPath) {
+    int src = open(persistPath, O_RDONLY);
+    if(src < 0)
+        return (errno == ENOENT) ? UA_STATUSCODE_GOOD : UA_STATUSCODE_BADINTERNALERROR;
+
+    UA_StatusCode res = UA_STATUSCODE_GOOD;
+    for(;;) {
+        ssize_t n = read(src, fs->staging, FILESTREAM_STAGING_SIZE);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0) {
+            res = UA_STATUSCODE_BADINTERNALERROR;
+            break;
+        }
+        if(n == 0)
+            break;
+        res = writeAll(fs->fd, fs->staging, (size_t)n, fs->length);
+        if(res != UA_STATUSCODE_GOOD)
+            break;
+        fs->length += (size_t)n;
+    }
+    close(src);
+    fs->stagingOffset = fs->length;
+    return res;
+}
+
+UA_StatusCode fileStreamOpen(FileStream *fs, const char *persistPath, UA_Boolean keepExisting) {
+    memset(fs, 0, sizeof(FileStream));
+
+    fs->staging = (UA_Byte*)malloc(FILESTREAM_STAGING_SIZE);
+    if(!fs->staging)
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+
+    fs->fd = fileCommitCreateTemp(persistPath, fs->tmpPath, sizeof(fs->tmpPath));
+    if(fs->fd < 0) {
+        free(fs->staging);
+        fs->staging = NULL;
+        return UA_STATUSCODE_BADINTERNALERROR;
+    }
+    fs->active = true;
+
+    if(keepExisting) {
+        UA_StatusCode res = copyExisting(fs, persistPath);
+        if(res != UA_STATUSCODE_GOOD) {
+            fileStreamAbort(fs);
+            return res;
+        }
+    }
+    return UA_STATUSCODE_GOOD;
+}
+
+UA_StatusCode fileStreamOpenAppend(FileStream *fs, const char *persistPath) {
+    memset(fs, 0, sizeof(FileStream));
+
+    fs->fd = open(persistPath, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if(fs->fd < 0 || fstat(fs->fd, &st) != 0) {
+        if(fs->fd >= 0)
+            close(fs->fd);
+        return UA_STATUSCODE_BADINTERNALERROR;
+    }
+    fs->length = (size_t)st.st_size;
+    fs->stagingOffset = fs->length;
+    fs->append = true;
+    fs->active = true;
+    return UA_STATUSCODE_GOOD;
+}
+
+UA_StatusCode fileStreamWrite(FileStream *fs, size_t offset, const UA_Byte *data,
+                              size_t length, FileBufferStats *stats) {
+    if(fs->active && fs->append)
+        return appendWrite(fs, data, length);
+    if(!fs->active || offset > fs->length)
+        return UA_STATUSCODE_BADINVALIDSTATE;
+
+    /* Not contiguous with the staged bytes: flush and restart at offset */
+    if(offset != fs->stagingOffset + fs->stagingUsed) {
+        UA_StatusCode res = flushStaging(fs);
+        if(res != UA_STATUSCODE_GOOD)
+            return res;
+        fs->stagingOffset = offset;
+    }
+
+    if(fs->stagingUsed + length > FILESTREAM_STAGING_SIZE) {
+        UA_StatusCode res = flushStaging(fs);
+        if(res != UA_STATUSCODE_GOOD)
+            return res;
+    }
+
+    if(length >= FILESTREAM_STAGING_SIZE) {
+        /* Large chunks go straight to disk without staging */
+        UA_StatusCode res = writeAll(fs->fd, data, length, offset);
+        if(res != UA_STATUSCODE_GOOD)
+            return res;
+        fs->stagingOffset = offset + length;
+    } else {
+        memcpy(fs->staging + fs->stagingUsed, data, length);
+        fs->stagingUsed += length;
+        if(stats)
+            stats->bytesCopied += length;
+    }
+
+    if(offset + length > fs->length)
+        fs->length = offset + length;
+    return UA_STATUSCODE_GOOD;
+}
+
+size_t fileStreamRead(FileStream *fs, size_t offset, UA_Byte *dst, size_t length) {
+    if(!fs->active)
+        return 0;
+    if(flushStaging(fs) != UA_STATUSCODE_GOOD)
+        return 0;
+    if(fs->append)
+        refreshAppend(fs);
+    if(offset >= fs->length)
+        return 0;
+    if(length > fs->length - offset)
+        length = fs->length - offset;
+
+    size_t done = 0;
+    while(done < length) {
+        ssize_t n = pread(fs->fd, dst + done, length - done, (off_t)(offset + done));
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        done += (size_t)n;
+    }
+    return done;
+}
+
+UA_StatusCode fileStreamFinish(FileStream *fs, int *fd) {
+    if(!fs->active)
+        return UA_STATUSCODE_BADINVALIDSTATE;
+
+    UA_StatusCode res = flushStaging(fs);
+    if(fs->append)
+        refreshAppend(fs);
+    free(fs->staging);
+    fs->staging = NULL;
+    fs->active = false;
+    if(res != UA_STATUSCODE_GOOD) {
+        close(fs->fd);
+        if(!fs->append)
+            unlink(fs->tmpPath);
+        return res;
+    }
+    *fd = fs->fd;
+    return UA_STATUSCODE_GOOD;
+}
+
+void fileStreamAbort(FileStream *fs) {
+    if(!fs->active)
+        return;
+    if(fs->append)
+        flushStaging(fs);
+    close(fs->fd);
+    if(!fs->append)
+        unlink(fs->tmpPath);
+    free(fs->staging);
+    fs->staging = NULL;
+    fs->active = false;
+}
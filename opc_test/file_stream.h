@@ -0,0 +1,52 @@
+#ifndef FILE_STREAM_H
+#define FILE_STREAM_H
+
+extern "C" {
+#include "open62541.h"
+}
+#include "file_buffer.h"
+#include <climits>
+
+/* Write-through storage: chunks are written to a temporary file at their
+ * file offset, coalesced in a bounded staging buffer. Memory use is
+ * FILESTREAM_STAGING_SIZE per open file, whatever the file size. */
+#define FILESTREAM_STAGING_SIZE ((size_t)256 * 1024)
+
+typedef struct {
+    UA_Boolean active;
+    UA_Boolean append;       /* writes go straight to the file, see below */
+    int      fd;
+    char     tmpPath[PATH_MAX];
+    UA_Byte *staging;
+    size_t   stagingOffset;  /* file offset of staging[0] */
+    size_t   stagingUsed;
+    size_t   length;         /* logical file length, staged bytes included */
+} FileStream;
+
+/* Creates the temporary file. With keepExisting the current content of
+ * persistPath is copied over first so it can be read and patched. */
+UA_StatusCode fileStreamOpen(FileStream *fs, const char *persistPath, UA_Boolean keepExisting);
+
+/* Append mode: the file itself is opened with O_APPEND and chunks are
+ * added at its end with write(), one write per chunk and no staging, so
+ * readers following the file see each chunk at once. Other
+ * processes may append as well: length follows the file on every write and
+ * read. Nothing is replaced at Close, tmpPath stays empty. Written bytes
+ * cannot be taken back, so fileStreamAbort keeps them as well. */
+UA_StatusCode fileStreamOpenAppend(FileStream *fs, const char *persistPath);
+
+/* offset must not lie beyond the current length; in append mode it is
+ * ignored and data goes to the end */
+UA_StatusCode fileStreamWrite(FileStream *fs, size_t offset, const UA_Byte *data,
+                              size_t length, FileBufferStats *stats);
+
+size_t fileStreamRead(FileStream *fs, size_t offset, UA_Byte *dst, size_t length);
+
+/* Flushes staged bytes and hands the temporary file (fd, tmpPath) over for
+ * fileCommit. The stream is inactive afterwards. */
+UA_StatusCode fileStreamFinish(FileStream *fs, int *fd);
+
+/* Drops the temporary file, or flushes and closes an append stream */
+void fileStreamAbort(FileStream *fs);
+
+#endif
@@ -1,22 +1,30 @@
 #include "file_manager.h"
+#include "file_catalog.h"
+#include "file_commit.h"
+#include "file_cache.h"
+#include "file_io.h"
+#include "file_log.h"
 #include "security_config.h"
 #include <cstring>
+#include <cstdlib>
 #include <iostream>
 
-/* Initialize three separate states with different paths */
-static FileState MenuState = { .buffer = NULL, .bufferSize = 0, .filePos = 0, .isOpen = false,
-                              .persistPath = "/home/praveenk/Desktop/OPC_UA_server_implementation/opc_test/Server_files_&_folders/Menu.txt" };
-
-static FileState logState    = { .buffer = NULL, .bufferSize = 0, .filePos = 0, .isOpen = false,
-                             .persistPath = "/home/praveenk/Desktop/OPC_UA_server_implementation/opc_test/Server_files_&_folders/system_logs.txt" };
-
-static FileState firmwareState    = { .buffer = NULL, .bufferSize = 0, .filePos = 0, .isOpen = false,
-                                  .persistPath = "/home/praveenk/Desktop/OPC_UA_server_implementation/opc_test/Server_files_&_folders/firmware.bin" };
+/* Files exposed by the device, see file_catalog.h for the format. Taken
+ * from the first argument or OPC_FILE_CATALOG, else from the working
+ * directory. */
+static const char *defaultCatalogPath = "file_catalog.conf";
+static FileCatalog catalog;
 
 static UA_NodeId myDeviceTypeId;
 static UA_NodeId myDeviceId;
 
-int main() {
+int main(int argc, char **argv) {
+    const char *catalogPath = getenv("OPC_FILE_CATALOG");
+    if(argc > 1)
+        catalogPath = argv[1];
+    else if(!catalogPath)
+        catalogPath = defaultCatalogPath;
+
     UA_Server *server = UA_Server_new();
 
     /* 2. LOAD SECURITY
@@ -32,6 +40,15 @@ int main() {
         return 1;
     }
 
+    /* Log through a ring buffer drained off the server thread */
+    fileLogInstall(server, UA_LOGLEVEL_INFO);
+
+    /* Release file handles of sessions that go away without Close */
+    fileManagerInit(server);
+
+    /* Disk I/O of Close (save, fdatasync, rename) runs off the server loop */
+    fileIoStart(server, 2);
+
     /* 1. Add Device Type */
     UA_ObjectTypeAttributes ta = UA_ObjectTypeAttributes_default;
     ta.displayName = UA_LOCALIZEDTEXT("", (char*)"MyDeviceType");
@@ -48,10 +65,11 @@ int main() {
                             UA_NODEID_NUMERIC(0, UA_NS0ID_ORGANIZES), UA_QUALIFIEDNAME(1, (char*)"MyDevice"),
                             myDeviceTypeId, oa, NULL, NULL);
 
-    /* 3. Add Three Separate File Instances */
-    addFileInstance(server, myDeviceId, "MenuFile", "MyDevice_MenuFile", &MenuState);
-    addFileInstance(server, myDeviceId, "LogFile",    "MyDevice_LogFile",    &logState);
-    addFileInstance(server, myDeviceId, "FimwareFile",    "MyDevice_FirmwareFile",    &firmwareState);
+    /* 3. Add the File Instances of the catalog */
+    fileCatalogLoad(server, myDeviceId, catalogPath, &catalog);
+
+    /* 4. Bulk distribution of files in one Call */
+    fileManagerAddWriteFiles(server, myDeviceId, "MyDevice");
 
     std::cout << "Server is running at opc.tcp://localhost:4840" << std::endl;
     std::cout << "Security Mode: Sign & Encrypt | Policy: Basic256Sha256" << std::endl;
@@ -61,9 +79,10 @@ int main() {
     UA_Server_run(server, &running);
 
     /* 7. CLEANUP */
-    if(MenuState.buffer) free(MenuState.buffer);
-    if(logState.buffer) free(logState.buffer);
-    if(firmwareState.buffer) free(firmwareState.buffer);
+    fileCommitSync();
+    fileIoStop(server);
+    fileCatalogClear(&catalog);
+    fileCacheClear();
 
     UA_ByteString_clear(&cert);
     UA_ByteString_clear(&key);
@@ -0,0 +1,150 @@
+/* Checks through the method calls of a server that a WriteFiles cannot
+ * overtake a Close of the same file still waiting in the group-commit
+ * window, so the newer content is the one left on disk. Built and run by
+ * run_tests.sh. */
+#include "../file_manager.h"
+#include "../file_commit.h"
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { \
+        printf("%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+        return; \
+    } \
+} while(0)
+
+static UA_CallMethodResult call(UA_Server *server, const char *object, UA_NodeId method,
+                                size_t inputSize, UA_Variant *input) {
+    UA_CallMethodRequest request;
+    UA_CallMethodRequest_init(&request);
+    request.objectId = UA_NODEID_STRING(1, (char*)object);
+    request.methodId = method;
+    request.inputArgumentsSize = inputSize;
+    request.inputArguments = input;
+    return UA_Server_call(server, &request);
+}
+
+static std::string fileContent(const char *path) {
+    std::string s;
+    FILE *f = fopen(path, "rb");
+    if(!f)
+        return s;
+    char buf[256];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        s.append(buf, n);
+    fclose(f);
+    return s;
+}
+
+/* Open for writing with EraseExisting, Write, Close */
+static UA_StatusCode closeWith(UA_Server *server, const char *object, const char *text) {
+    UA_Byte mode = 0x06;
+    UA_Variant in[2];
+    UA_Variant_setScalar(&in[0], &mode, &UA_TYPES[UA_TYPES_BYTE]);
+    UA_CallMethodResult r = call(server, object, UA_NODEID_NUMERIC(0, UA_NS0ID_FILETYPE_OPEN), 1, in);
+    UA_StatusCode res = r.statusCode;
+    UA_UInt32 handle = 0;
+    if(res == UA_STATUSCODE_GOOD && r.outputArgumentsSize == 1)
+        handle = *(UA_UInt32*)r.outputArguments[0].data;
+    UA_CallMethodResult_clear(&r);
+    if(res != UA_STATUSCODE_GOOD)
+        return res;
+
+    UA_ByteString data = UA_BYTESTRING((char*)text);
+    UA_Variant_setScalar(&in[0], &handle, &UA_TYPES[UA_TYPES_UINT32]);
+    UA_Variant_setScalar(&in[1], &data, &UA_TYPES[UA_TYPES_BYTESTRING]);
+    r = call(server, object, UA_NODEID_NUMERIC(0, UA_NS0ID_FILETYPE_WRITE), 2, in);
+    res = r.statusCode;
+    UA_CallMethodResult_clear(&r);
+    if(res != UA_STATUSCODE_GOOD)
+        return res;
+
+    r = call(server, object, UA_NODEID_NUMERIC(0, UA_NS0ID_FILETYPE_CLOSE), 1, in);
+    res = r.statusCode;
+    UA_CallMethodResult_clear(&r);
+    return res;
+}
+
+/* WriteFiles of one file, the result of that file */
+static UA_StatusCode writeFiles(UA_Server *server, const char *file, const char *text) {
+    UA_NodeId id = UA_NODEID_STRING(1, (char*)file);
+    UA_ByteString data = UA_BYTESTRING((char*)text);
+    UA_Variant in[2];
+    UA_Variant_setArray(&in[0], &id, 1, &UA_TYPES[UA_TYPES_NODEID]);
+    UA_Variant_setArray(&in[1], &data, 1, &UA_TYPES[UA_TYPES_BYTESTRING]);
+    UA_CallMethodResult r = call(server, "Dev", UA_NODEID_STRING(1, (char*)"Dev/WriteFiles"), 2, in);
+    UA_StatusCode res = r.statusCode;
+    if(res == UA_STATUSCODE_GOOD && r.outputArgumentsSize == 1 &&
+       r.outputArguments[0].arrayLength == 1)
+        res = ((UA_StatusCode*)r.outputArguments[0].data)[0];
+    UA_CallMethodResult_clear(&r);
+    return res;
+}
+
+static void checkCloseThenWriteFiles(UA_Server *server, FileState *fs) {
+    /* The window is long enough that only a flush submits the Close */
+    fileCommitSetGroupWindow(60000.0);
+    CHECK(closeWith(server, "Dev/a", "from close") == UA_STATUSCODE_GOOD);
+    CHECK(fs->pendingCommits == 1);
+
+    /* Rejected while the Close is pending, which is flushed for the retry */
+    CHECK(writeFiles(server, "Dev/a", "from writefiles") == UA_STATUSCODE_BADRESOURCEUNAVAILABLE);
+    fileCommitSync();
+    CHECK(fs->pendingCommits == 0);
+    CHECK(fileContent(fs->persistPath) == "from close");
+
+    CHECK(writeFiles(server, "Dev/a", "from writefiles") == UA_STATUSCODE_GOOD);
+    fileCommitSync();
+    CHECK(fileContent(fs->persistPath) == "from writefiles");
+    fileCommitSetGroupWindow(0.0);
+}
+
+int main(void) {
+    char dir[] = "/tmp/file_commit_test.XXXXXX";
+    if(!mkdtemp(dir)) {
+        printf("mkdtemp failed\n");
+        return 1;
+    }
+    std::string path = std::string(dir) + "/a";
+
+    UA_Server *server = UA_Server_new();
+    UA_ServerConfig_setDefault(UA_Server_getConfig(server));
+    fileManagerInit(server);
+
+    UA_ObjectAttributes oa = UA_ObjectAttributes_default;
+    oa.displayName = UA_LOCALIZEDTEXT("", (char*)"Dev");
+    UA_Server_addObjectNode(server, UA_NODEID_STRING(1, (char*)"Dev"),
+                            UA_NODEID_NUMERIC(0, UA_NS0ID_OBJECTSFOLDER),
+                            UA_NODEID_NUMERIC(0, UA_NS0ID_ORGANIZES), UA_QUALIFIEDNAME(1, (char*)"Dev"),
+                            UA_NODEID_NUMERIC(0, UA_NS0ID_BASEOBJECTTYPE), oa, NULL, NULL);
+    fileManagerAddWriteFiles(server, UA_NODEID_STRING(1, (char*)"Dev"), "Dev");
+    FileState *fs = fileStateNew(path.c_str(), false);
+    if(addFileInstance(server, UA_NODEID_STRING(1, (char*)"Dev"), "a", "Dev/a", fs) !=
+       UA_STATUSCODE_GOOD) {
+        printf("addFileInstance failed\n");
+        failures++;
+    } else {
+        checkCloseThenWriteFiles(server, fs);
+    }
+
+    fileCommitSync();
+    UA_Server_delete(server);
+    fileStateDelete(fs);
+    unlink(path.c_str());
+    rmdir(dir);
+
+    if(failures > 0) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("all passed\n");
+    return 0;
+}
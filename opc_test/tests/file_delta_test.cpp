@@ -0,0 +1,137 @@
+/* Checks that the recipes of fileDeltaMatch rebuild the new version from
+ * the old one, for files that grew, shrank or stayed the same, with and
+ * without a short last block, and the limit on the block count. Built
+ * and run by run_tests.sh. */
+#include "../file_delta.h"
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { \
+        printf("%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+        return; \
+    } \
+} while(0)
+
+static size_t vectorSource(void *context, size_t offset, UA_Byte *dst, size_t length) {
+    const std::vector<UA_Byte> *v = (const std::vector<UA_Byte>*)context;
+    if(offset >= v->size())
+        return 0;
+    if(length > v->size() - offset)
+        length = v->size() - offset;
+    if(length > 0)
+        memcpy(dst, &(*v)[offset], length);
+    return length;
+}
+
+static UA_UInt64 getLE(const UA_Byte *p, size_t n) {
+    UA_UInt64 v = 0;
+    for(size_t i = n; i > 0; i--)
+        v = (v << 8) | p[i - 1];
+    return v;
+}
+
+static std::vector<UA_Byte> randomBytes(size_t length) {
+    std::vector<UA_Byte> v(length);
+    for(size_t i = 0; i < length; i++)
+        v[i] = (UA_Byte)rand();
+    return v;
+}
+
+/* Rebuilds the new version: copies from the old one, ranges read from the new one */
+static void checkRecipe(const char *name, std::vector<UA_Byte> oldVersion,
+                        std::vector<UA_Byte> newVersion, UA_UInt32 blockSize) {
+    UA_ByteString signatures, recipe;
+    CHECK(fileDeltaSignatures(vectorSource, &oldVersion, oldVersion.size(), blockSize,
+                              &signatures) == UA_STATUSCODE_GOOD);
+    UA_StatusCode res = fileDeltaMatch(&signatures, vectorSource, &newVersion,
+                                       newVersion.size(), &recipe);
+    UA_ByteString_clear(&signatures);
+    CHECK(res == UA_STATUSCODE_GOOD);
+
+    std::vector<UA_Byte> rebuilt;
+    size_t copied = 0;
+    UA_Boolean valid = (recipe.length % 13) == 0;
+    for(size_t p = 0; valid && p < recipe.length; p += 13) {
+        UA_Byte op = recipe.data[p];
+        UA_UInt64 offset = getLE(recipe.data + p + 1, 8);
+        UA_UInt64 length = getLE(recipe.data + p + 9, 4);
+        const std::vector<UA_Byte> &from = (op == 'C') ? oldVersion : newVersion;
+        valid = (op == 'C' || (op == 'R' && offset == rebuilt.size())) &&
+            offset <= from.size() && length <= from.size() - offset;
+        if(valid)
+            rebuilt.insert(rebuilt.end(), from.begin() + (size_t)offset,
+                           from.begin() + (size_t)(offset + length));
+        if(op == 'C')
+            copied += (size_t)length;
+    }
+    UA_ByteString_clear(&recipe);
+    CHECK(valid);
+    CHECK(rebuilt == newVersion);
+    printf("%-28s old %7zu new %7zu copied %7zu\n", name, oldVersion.size(),
+           newVersion.size(), copied);
+}
+
+/* Requested block sizes are grown too, so the signatures stay small */
+static void checkBlockSize(void) {
+    size_t large = (size_t)1024 * 1024 * 1024;
+    CHECK(fileDeltaBlockSize(large, 512) >= large / 16384);
+    CHECK(fileDeltaBlockSize(large, 0) >= large / 16384);
+    CHECK(fileDeltaBlockSize(100000, 512) == 512);
+    CHECK(fileDeltaBlockSize(100000, 1) == FILEDELTA_MIN_BLOCK);
+    CHECK(fileDeltaBlockSize(100000, 0xFFFFFFFF) == FILEDELTA_MAX_BLOCK);
+    printf("%-28s ok\n", "block size cap");
+}
+
+int main(void) {
+    srand(1);
+    checkBlockSize();
+    std::vector<UA_Byte> aligned = randomBytes(4 * 4096);
+    std::vector<UA_Byte> shortTail = randomBytes(4 * 4096 + 100);
+    std::vector<UA_Byte> large = randomBytes(300000);
+
+    /* Identical */
+    checkRecipe("identical aligned", aligned, aligned, 0);
+    checkRecipe("identical short tail", shortTail, shortTail, 0);
+    checkRecipe("identical large", large, large, 0);
+
+    /* Grown, as a log that is appended to */
+    std::vector<UA_Byte> grown = shortTail;
+    std::vector<UA_Byte> tail = randomBytes(152);
+    grown.insert(grown.end(), tail.begin(), tail.end());
+    checkRecipe("grown short tail", shortTail, grown, 0);
+    grown = aligned;
+    grown.insert(grown.end(), tail.begin(), tail.end());
+    checkRecipe("grown aligned", aligned, grown, 0);
+    grown = large;
+    tail = randomBytes(70000);
+    grown.insert(grown.end(), tail.begin(), tail.end());
+    checkRecipe("grown large", large, grown, 4096);
+
+    /* Shrunk */
+    checkRecipe("shrunk short tail", shortTail,
+                std::vector<UA_Byte>(shortTail.begin(), shortTail.begin() + 3 * 4096 + 7), 0);
+    checkRecipe("shrunk aligned", aligned,
+                std::vector<UA_Byte>(aligned.begin(), aligned.begin() + 2 * 4096), 0);
+    checkRecipe("shrunk to nothing", large, std::vector<UA_Byte>(), 0);
+
+    /* Edited in the middle */
+    std::vector<UA_Byte> edited = large;
+    edited.insert(edited.begin() + 50000, 37, 1);
+    edited.erase(edited.begin() + 200000, edited.begin() + 200100);
+    edited[250000] ^= 1;
+    checkRecipe("edited", large, edited, 0);
+    checkRecipe("edited, small blocks", large, edited, 512);
+
+    if(failures > 0) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("all passed\n");
+    return 0;
+}
@@ -0,0 +1,16 @@
+#!/bin/bash
+# Builds and runs the unit tests. Run from opc_test after build.sh, which
+# leaves open62541.o and the module objects behind.
+cd "$(dirname "$0")/.." || exit 1
+
+FLAGS="-DUA_ENABLE_ENCRYPTION -DUA_ENABLE_ENCRYPTION_MBEDTLS"
+LIBS="-lpthread -lmbedtls -lmbedx509 -lmbedcrypto -lz"
+MODULES="file_manager.o file_buffer.o file_stream.o file_mapping.o file_cache.o file_compress.o \
+file_store.o file_digest.o file_delta.o file_commit.o file_io.o file_log.o"
+
+g++ -std=c++11 tests/file_delta_test.cpp file_delta.o open62541.o -o tests/file_delta_test $FLAGS \
+    -lpthread -lmbedtls -lmbedx509 -lmbedcrypto || exit 1
+g++ -std=c++11 tests/file_commit_test.cpp $MODULES open62541.o -o tests/file_commit_test $FLAGS \
+    $LIBS || exit 1
+./tests/file_delta_test || exit 1
+./tests/file_commit_test